@@ -5,9 +5,19 @@
  * Make sure NOT to modify printState or any of the associated functions
 **/
 
+#ifdef PROFILE
+#define _GNU_SOURCE // syscall(), for perf_event_open
+#endif
+#define _POSIX_C_SOURCE 200809L // clock_gettime, sysconf
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
 
 // Machine Definitions
 #define NUMMEMORY 65536 // maximum number of data words in memory
@@ -35,339 +45,4566 @@ const char* opcode_to_str_map[] = {
 
 #define NOOPINSTR (NOOP << 22)
 
+// Pipeline latches, in program order, as indices into latchPc
+#define TAG_IFID 0
+#define TAG_IDEX 1
+#define TAG_EXMEM 2
+#define TAG_MEMWB 3
+#define TAG_WBEND 4
+#define NUMSTAGES 5
+
+// Branch prediction, see configType
+#define PREDICT_NOTTAKEN 0
+#define PREDICT_BACKWARD 1 // backward taken, forward not taken
+#define PREDICT_TAKEN 2
+
+// Pipeline variations for "what if" runs. The zero config is the project's pipeline.
+typedef struct configStruct {
+    int memLatency; // extra cycles every lw and sw spends in MEM
+    int earlyLoad; // loaded words can be forwarded out of EX/MEM, so no load-use stall
+    int predict; // how fetch predicts branches, one of PREDICT_
+    int resolveInEx; // branches resolve in EX instead of MEM
+} configType;
+
+const configType defaultConfig = { 0, 0, PREDICT_NOTTAKEN, 0 };
+
+typedef struct statsStruct {
+    unsigned long long loadStalls; // bubbles inserted for load-use hazards
+    unsigned long long memStalls; // cycles spent waiting on memory
+    unsigned long long branches; // branches resolved
+    unsigned long long mispredicts; // branches that squashed the instructions behind them
+} statsType;
+
 typedef struct IFIDStruct {
 	int pcPlus1;
 	int instr;
 } IFIDType;
 
-typedef struct IDEXStruct {
-	int pcPlus1;
-	int valA;
-	int valB;
-	int offset;
-	int instr;
-} IDEXType;
+typedef struct IDEXStruct {
+	int pcPlus1;
+	int valA;
+	int valB;
+	int offset;
+	int instr;
+} IDEXType;
+
+typedef struct EXMEMStruct {
+	int branchTarget;
+    int eq;
+	int aluResult;
+	int valB;
+	int instr;
+} EXMEMType;
+
+typedef struct MEMWBStruct {
+	int writeData;
+    int instr;
+} MEMWBType;
+
+typedef struct WBENDStruct {
+	int writeData;
+	int instr;
+} WBENDType;
+
+typedef struct stateStruct {
+	int pc;
+	int instrMem[NUMMEMORY];
+	int dataMem[NUMMEMORY];
+	int reg[NUMREGS];
+	unsigned int numMemory;
+	IFIDType IFID;
+	IDEXType IDEX;
+	EXMEMType EXMEM;
+	MEMWBType MEMWB;
+	WBENDType WBEND;
+	unsigned int cycles; // number of cycles run so far
+	// Simulator bookkeeping, not part of the pipeline and never printed:
+	// the pc each latch's instruction was fetched from, -1 for a bubble
+	int latchPc[NUMSTAGES];
+	int memWait; // cycles the lw or sw in EX/MEM still has to wait
+	statsType stats;
+} stateType;
+
+static inline int opcode(int instruction) {
+    return instruction>>22;
+}
+
+static inline int field0(int instruction) {
+    return (instruction>>19) & 0x7;
+}
+
+static inline int field1(int instruction) {
+    return (instruction>>16) & 0x7;
+}
+
+static inline int field2(int instruction) {
+    return instruction & 0xFFFF;
+}
+
+// convert a 16-bit number into a 32-bit Linux integer
+static inline int convertNum(int num) {
+    return num - ( (num & (1<<15)) ? 1<<16 : 0 );
+}
+
+void printState(stateType*);
+void printInstruction(int);
+void readMachineCode(stateType*, char*);
+const char *symbolName(int);
+
+#define MAXLINELENGTH 1000 // MAXLINELENGTH is the max number of characters we read
+
+/* --------------------- Profiling --------------------- */
+// In a PROFILE build (make simulator-profile) the simulator times itself.
+// Each PROF_REGION ends the region being timed and starts the next one. Time
+// is counted in rdtsc ticks, plus hardware counters wherever
+// perf_event_open lets us have them. The table goes to stderr at exit. Only
+// the main thread is reported. In normal builds the macros are empty.
+
+#ifdef PROFILE
+#include <stdint.h>
+#include <errno.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+enum { PROF_OTHER, PROF_COPY, PROF_IF, PROF_ID, PROF_EX, PROF_MEM, PROF_WB, PROF_PRINT, NUMPROF };
+const char *profNames[NUMPROF] = { "other", "state copy", "IF", "ID", "EX", "MEM", "WB", "printState" };
+
+#define PROF_NUMFIELDS 5 // ticks, then the counters
+const char *profFieldNames[PROF_NUMFIELDS] = { "ticks", "cycles", "instrs", "cache-miss", "branch-miss" };
+
+typedef struct profStruct {
+    int region; // being timed now
+    uint64_t last[PROF_NUMFIELDS]; // readings when it started
+    uint64_t total[NUMPROF][PROF_NUMFIELDS];
+    unsigned long long entries[NUMPROF];
+    double overhead[PROF_NUMFIELDS]; // what one reading adds to the region it ends
+    int slot[PROF_NUMFIELDS]; // where the counter is in a group read, -1 if we don't have it
+    int leader; // fd of the counter group, -1 if there isn't one
+    int numOpen;
+    int error; // errno from the first counter that wouldn't open
+} profType;
+
+static __thread profType prof = { .leader = -1 };
+
+static inline uint64_t profTicks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+#endif
+}
+
+static inline void profRead(uint64_t *now) {
+    now[0] = profTicks();
+#ifdef __linux__
+    uint64_t group[1 + PROF_NUMFIELDS]; // count, then values
+    if (prof.numOpen && read(prof.leader, group, sizeof(group)) > 0){
+        for (int i = 1; i < PROF_NUMFIELDS; i++){
+            now[i] = prof.slot[i] >= 0 ? group[1 + prof.slot[i]] : 0;
+        }
+    }
+#endif
+}
+
+static inline void profRegion(int region) {
+    uint64_t now[PROF_NUMFIELDS] = { 0 };
+    profRead(now);
+    for (int i = 0; i < PROF_NUMFIELDS; i++){
+        prof.total[prof.region][i] += now[i] - prof.last[i];
+        prof.last[i] = now[i];
+    }
+    prof.entries[region]++;
+    prof.region = region;
+}
+
+void profReport(void) {
+    uint64_t sum[PROF_NUMFIELDS] = { 0 };
+    double net[NUMPROF][PROF_NUMFIELDS];
+    profRegion(PROF_OTHER);
+    for (int r = 0; r < NUMPROF; r++){
+        for (int i = 0; i < PROF_NUMFIELDS; i++){
+            net[r][i] = prof.total[r][i] - prof.overhead[i] * prof.entries[r];
+            net[r][i] = net[r][i] > 0 ? net[r][i] : 0;
+            sum[i] += net[r][i];
+        }
+    }
+    if (!prof.numOpen){
+        fprintf(stderr, "profile: no perf counters (%s), rdtsc only\n", strerror(prof.error));
+    }
+    fprintf(stderr, "profile: %-10s %12s %7s", "region", "entries", "%ticks");
+    for (int i = 0; i < PROF_NUMFIELDS; i++){
+        fprintf(stderr, " %14s", profFieldNames[i]);
+    }
+    fprintf(stderr, "\n");
+    for (int r = 0; r < NUMPROF; r++){
+        fprintf(stderr, "profile: %-10s %12llu %6.1f%%", profNames[r], prof.entries[r],
+            sum[0] ? 100.0 * net[r][0] / sum[0] : 0.0);
+        for (int i = 0; i < PROF_NUMFIELDS; i++){
+            if (i == 0 || prof.slot[i] >= 0){
+                fprintf(stderr, " %14.0f", net[r][i]);
+            }
+            else{
+                fprintf(stderr, " %14s", "-");
+            }
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+// Open whichever counters we can as one group, measure what a reading
+// costs, and report at exit
+void profInit(void) {
+    prof.slot[0] = -1;
+    for (int i = 1; i < PROF_NUMFIELDS; i++){
+        prof.slot[i] = -1;
+    }
+#ifdef __linux__
+    static const unsigned long long events[PROF_NUMFIELDS] = { 0, PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+    for (int i = 1; i < PROF_NUMFIELDS; i++){
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = events[i];
+        attr.disabled = prof.leader < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+        int fd = syscall(__NR_perf_event_open, &attr, 0, -1, prof.leader, 0);
+        if (fd < 0){
+            prof.error = prof.error ? prof.error : errno;
+            continue;
+        }
+        prof.leader = prof.leader < 0 ? fd : prof.leader;
+        prof.slot[i] = prof.numOpen++;
+    }
+    if (prof.numOpen){
+        ioctl(prof.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#else
+    prof.error = ENOSYS;
+#endif
+
+    uint64_t first[PROF_NUMFIELDS] = { 0 }, now[PROF_NUMFIELDS] = { 0 };
+    profRead(first);
+    for (int i = 0; i < 1000; i++){
+        profRead(now);
+    }
+    for (int i = 0; i < PROF_NUMFIELDS; i++){
+        prof.overhead[i] = (now[i] - first[i]) / 1000.0;
+    }
+    profRead(prof.last);
+    atexit(profReport);
+}
+
+#define PROF_INIT() profInit()
+#define PROF_REGION(region) profRegion(region)
+#else
+#define PROF_INIT() ((void)0)
+#define PROF_REGION(region) ((void)0)
+#endif
+
+
+// Put the machine in its reset state after the program has been loaded
+void resetState(stateType *state) {
+    // All registers in the processor should be initialized to 0, alongside the program counter.
+    // Initialize registers to 0
+    for (int i = 0; i < NUMREGS; i++){
+        state->reg[i] = 0;
+    }
+    // program counter is initialized to 0
+    state->pc = 0;
+
+    // The instruction field in all pipeline registers should be initialized to the noop instruction
+    // Initialize pipeline registers to NOOP
+    state->IFID.instr = NOOPINSTR;
+    state->IDEX.instr = NOOPINSTR;
+    state->EXMEM.instr = NOOPINSTR;
+    state->MEMWB.instr = NOOPINSTR;
+    state->WBEND.instr = NOOPINSTR;
+    for (int i = 0; i < NUMSTAGES; i++){
+        state->latchPc[i] = -1; // all bubbles
+    }
+    state->memWait = 0;
+    memset(&state->stats, 0, sizeof(state->stats));
+
+    // Initialize state here
+    state->cycles = 0; // set cycles to 0
+}
+
+// Copy everything except instrMem and dataMem. Copying the whole stateType moves
+// half a megabyte of memory every cycle even though at most one word of dataMem
+// changes, so the memories are kept in sync by commitCycle instead.
+void copyLatches(stateType *dst, const stateType *src) {
+    PROF_REGION(PROF_COPY);
+    dst->pc = src->pc;
+    memcpy(dst->reg, src->reg, sizeof(dst->reg));
+    dst->numMemory = src->numMemory;
+    dst->IFID = src->IFID;
+    dst->IDEX = src->IDEX;
+    dst->EXMEM = src->EXMEM;
+    dst->MEMWB = src->MEMWB;
+    dst->WBEND = src->WBEND;
+    dst->cycles = src->cycles;
+    memcpy(dst->latchPc, src->latchPc, sizeof(dst->latchPc));
+    dst->memWait = src->memWait;
+    dst->stats = src->stats;
+}
+
+static inline int predictTaken(const configType *config, int instr) {
+    return config->predict == PREDICT_TAKEN
+        || (config->predict == PREDICT_BACKWARD && convertNum(field2(instr)) < 0);
+}
+
+// The WB stage: MEM/WB moves to WB/END and writes the register file
+void writeBack(const stateType *state, stateType *newState) {
+    PROF_REGION(PROF_WB);
+    /* ---------------------- WB stage --------------------- */
+    // WB = Register write back
+    newState->WBEND.instr = state->MEMWB.instr; // new state stage gets instruction from previous stage
+    newState->latchPc[TAG_WBEND] = state->latchPc[TAG_MEMWB];
+    newState->WBEND.writeData = state->MEMWB.writeData; // new state stage gets writeData from previous stage
+
+
+    // two write back cases
+    // add and nor (effectivly the same)
+    // lw
+    // fuck me i had exmem for nor instesad of wbend
+    if (opcode(newState->WBEND.instr) == ADD || opcode(newState->WBEND.instr) == NOR){
+        newState->reg[field2(state->MEMWB.instr)] = state->MEMWB.writeData; // set reg at field2 to writeData
+    }
+    // changed to if instead of else if
+    if (opcode(newState->WBEND.instr) == LW){
+        newState->reg[field1(state->MEMWB.instr)] = state->MEMWB.writeData; // set reg at field1 to writeData
+    }
+}
+
+// Simulate one clock cycle: read state, write newState.
+// newState->dataMem must match state->dataMem on entry.
+void runCycle(const configType *config, const stateType *state, stateType *newState) {
+    copyLatches(newState, state);
+    newState->cycles += 1;
+
+    // A slow memory access holds up everything up to MEM while the older
+    // instructions drain through WB. The instruction waiting in ID/EX re-reads
+    // its registers, since what it would have forwarded has now left WB/END.
+    if (state->memWait > 0){
+        newState->memWait--;
+        newState->stats.memStalls++;
+        writeBack(state, newState);
+        newState->MEMWB.instr = NOOPINSTR;
+        newState->MEMWB.writeData = 0;
+        newState->latchPc[TAG_MEMWB] = -1;
+        newState->IDEX.valA = newState->reg[field0(state->IDEX.instr)];
+        newState->IDEX.valB = newState->reg[field1(state->IDEX.instr)];
+        PROF_REGION(PROF_OTHER);
+        return;
+    }
+
+    // detect and forward destinations
+    int EXEM_det_and_forward = 0;
+    int MEMWB_det_and_forward = 0;
+    int WBEND_det_and_forward = 0;
+
+    /* ---------------------- IF stage --------------------- */
+    // IF = Instruction Fetch
+    PROF_REGION(PROF_IF);
+    newState->IFID.instr = state->instrMem[state->pc];  // new state stage gets instruction from memory
+    newState->IFID.pcPlus1 = state->pc + 1; 
+    newState->pc++; // increment pc
+    newState->latchPc[TAG_IFID] = state->pc;
+    if (opcode(newState->IFID.instr) == BEQ && predictTaken(config, newState->IFID.instr)){
+        // a wrong-path word can look like a branch to anywhere, so only
+        // targets inside memory are followed
+        int target = state->pc + 1 + convertNum(field2(newState->IFID.instr));
+        if (target >= 0 && target < NUMMEMORY){
+            newState->pc = target;
+        }
+    }
+
+
+    /* ---------------------- ID stage --------------------- */
+    // ID = Instruction Decode
+    PROF_REGION(PROF_ID);
+    newState->IDEX.instr = state->IFID.instr; // new state stage gets instruction from previous stage
+    newState->IDEX.pcPlus1 = state->IFID.pcPlus1; // new state stage gets pcPlus1 from previous stage
+    newState->latchPc[TAG_IDEX] = state->latchPc[TAG_IFID];
+
+    // hazard potential LW
+    if (opcode(state->IDEX.instr) == LW && !config->earlyLoad){
+        // check if field0 newstate and field1 state are the same
+        // then check if field1 newstate and field1 state are the same
+        // also check if field0 newstate and field1 state are the same
+        // if either are the same, then stall with noop
+        if (field1(newState->IDEX.instr) == field1(state->IDEX.instr) || field0(newState->IDEX.instr) == field1(state->IDEX.instr)){
+            // if they are the same, then stall with noop
+            newState->pc = state->pc; // unincriment pc
+            newState->IFID = state->IFID; // set state instruction
+            newState->IDEX.instr = NOOPINSTR; // give noop this cycle
+            newState->latchPc[TAG_IFID] = state->latchPc[TAG_IFID];
+            newState->latchPc[TAG_IDEX] = -1;
+            newState->stats.loadStalls++;
+        }
+        else{ // no data hazard
+        // get register values and offset for LW and send them to next stage
+        newState->IDEX.valA = state->reg[field0(state->IFID.instr)];
+        newState->IDEX.valB = state->reg[field1(state->IFID.instr)];
+        newState->IDEX.offset = convertNum(field2(state->IFID.instr));
+        }
+    }
+    else{ // no data hazard
+        // get register values and offset for LW and send them to next stage
+        newState->IDEX.valA = state->reg[field0(state->IFID.instr)];
+        newState->IDEX.valB = state->reg[field1(state->IFID.instr)];
+        newState->IDEX.offset = convertNum(field2(state->IFID.instr));
+    }
+
+
+    /* ---------------------- EX stage --------------------- */
+    // EX = Execute
+    PROF_REGION(PROF_EX);
+    newState->EXMEM.instr = state->IDEX.instr; // new state stage gets instruction from previous stage
+    newState->latchPc[TAG_EXMEM] = state->latchPc[TAG_IDEX];
+    newState->EXMEM.branchTarget = state->IDEX.pcPlus1 + state->IDEX.offset; // set branch target if needed
+    // int writeBackDestReg = 0; // set destination register to 0
+    // int memDestReg = 0; // set destination register to 0
+    // int exmemDestReg = 0; // set destination register to 0
+    // NOW DECLARED OUTSIDE LOOP
+    int reg0Value = state->IDEX.valA; // set reg0Value so that the value can be used and not be overwritten
+    int reg1Value = state->IDEX.valB; // set reg1Value so that the value can be used and not be overwritten
+    // what EX/MEM forwards; with early loads that's the word a lw is reading
+    int exmemValue = state->EXMEM.aluResult;
+    if (config->earlyLoad && opcode(state->EXMEM.instr) == LW){
+        exmemValue = state->dataMem[state->EXMEM.aluResult];
+    }
+
+    // if LW for write back state instruction set destination register to field1
+    if (opcode(state->WBEND.instr) == LW){
+        WBEND_det_and_forward = field1(state->WBEND.instr);
+    }
+    else { // instruction is anythting but LW so set destination register to field2
+        WBEND_det_and_forward = field2(state->WBEND.instr);
+    }
+
+    // repeat for MEMWB
+    if (opcode(state->MEMWB.instr) == LW){
+        MEMWB_det_and_forward = field1(state->MEMWB.instr);
+    }
+    else {
+        MEMWB_det_and_forward = field2(state->MEMWB.instr);
+    }
+
+    // repeat for EXMEM
+    if (opcode(state->EXMEM.instr) == LW){
+        EXEM_det_and_forward = field1(state->EXMEM.instr);
+    }
+    else {
+        EXEM_det_and_forward = field2(state->EXMEM.instr);
+    }
+
+    // data hazard branching time
+    // idea is forward and correct later
+    // add, nor, lw can cause
+    if (opcode(state->WBEND.instr) == ADD || opcode(state->WBEND.instr) == NOR || opcode(state->WBEND.instr) == LW){
+        // if write back destination matches field0 or field1 of new state instruction
+        if (field0(newState->EXMEM.instr) == WBEND_det_and_forward){
+            // set reg0Value to write back value
+            reg0Value = state->WBEND.writeData;
+        }
+        if (field1(newState->EXMEM.instr) == WBEND_det_and_forward){
+            // set reg1Value to write back value
+            reg1Value = state->WBEND.writeData;
+        }
+    }
+
+    // repeate for MEMWB
+    if (opcode(state->MEMWB.instr) == ADD || opcode(state->MEMWB.instr) == NOR || opcode(state->MEMWB.instr) == LW){
+        // if write back destination matches field0 or field1 of new state instruction
+        if (field0(newState->EXMEM.instr) == MEMWB_det_and_forward){
+            // set reg0Value to write back value
+            reg0Value = state->MEMWB.writeData;
+        }
+        if (field1(newState->EXMEM.instr) == MEMWB_det_and_forward){
+            // set reg1Value to write back value
+            reg1Value = state->MEMWB.writeData;
+        }
+    }
+
+    // repeate for EXMEM
+    if (opcode(state->EXMEM.instr) == ADD || opcode(state->EXMEM.instr) == NOR || opcode(state->EXMEM.instr) == LW){
+        // if write back destination matches field0 or field1 of new state instruction
+        if (field0(newState->EXMEM.instr) == EXEM_det_and_forward){
+            // set reg0Value to write back value
+            reg0Value = exmemValue;
+        }
+        if (field1(newState->EXMEM.instr) == EXEM_det_and_forward){
+            // set reg1Value to write back value
+            reg1Value = exmemValue;
+        }
+    }
+
+
+    // determine aluResult based on opcode
+    if (opcode(newState->EXMEM.instr) == ADD){ // is ADD
+        newState->EXMEM.aluResult = reg0Value + reg1Value; // set aluResult to reg0Value + reg1Value (aka add)
+    }
+    else if (opcode(newState->EXMEM.instr) == LW || opcode(newState->EXMEM.instr) == SW){ // is LW
+        newState->EXMEM.aluResult = reg0Value + state->IDEX.offset; // set aluResult to reg0Value + current state offset
+    }
+    else if (opcode(newState->EXMEM.instr) == BEQ){ // is BEQ
+        newState->EXMEM.aluResult = reg0Value - reg1Value; // set aluResult to reg0Value - reg1Value (cause beq magic)
+        // if reg0Value == reg1Value
+        if (reg0Value == reg1Value){
+            newState->EXMEM.eq = 1; // set eq to 1
+        }
+        else{ // reg0Value != reg1Value
+            newState->EXMEM.eq = 0; // set eq to 0
+        }
+        if (config->resolveInEx){
+            newState->stats.branches++;
+            if (newState->EXMEM.eq != predictTaken(config, newState->EXMEM.instr)){
+                // only the two instructions behind it need squashing
+                newState->stats.mispredicts++;
+                newState->IFID.instr = NOOPINSTR;
+                newState->IDEX.instr = NOOPINSTR;
+                newState->latchPc[TAG_IFID] = newState->latchPc[TAG_IDEX] = -1;
+                newState->pc = newState->EXMEM.eq ? newState->EXMEM.branchTarget : state->IDEX.pcPlus1;
+            }
+        }
+
+    }
+    else if (opcode(newState->EXMEM.instr) == NOR){ // is NOR
+        newState->EXMEM.aluResult = ~(reg0Value | reg1Value); // set aluResult to ~(reg0Value | reg1Value) (aka bitwise nor)
+        // print result
+        //printf("nor result: %d\n", newState->EXMEM.aluResult);
+    }
+
+    if (opcode(newState->EXMEM.instr) != NOOP){ // not a NOOP
+        newState->EXMEM.valB = reg1Value; // set valB to reg1Value
+    }
+    else{
+        newState->EXMEM.aluResult = 0; // reset valB to 0
+    }
+    if (opcode(newState->EXMEM.instr) == LW || opcode(newState->EXMEM.instr) == SW){
+        newState->memWait = config->memLatency;
+    }
+
+    /* --------------------- MEM stage --------------------- */
+    // MEM = Memory access
+    PROF_REGION(PROF_MEM);
+    newState->MEMWB.instr = state->EXMEM.instr; // new state stage gets instruction from previous stage
+    newState->latchPc[TAG_MEMWB] = state->latchPc[TAG_EXMEM];
+    // newState->MEMWB.writeData = state->EXMEM.aluResult; // new state stage gets aluResult from previous stage
+
+    // opcode operations
+    if (opcode(newState->MEMWB.instr) == LW){
+        newState->MEMWB.writeData = state->dataMem[state->EXMEM.aluResult]; // set writeData to dataMem at aluResult
+    }
+    else if (opcode(newState->MEMWB.instr) == SW){ 
+        // memory is changed in this stage and the location was calculated in the previous stage through the alu
+        newState->dataMem[state->EXMEM.aluResult] = state->EXMEM.valB; // set dataMem at aluResult to valB
+    }
+    else if (opcode(newState->MEMWB.instr) == BEQ){
+        // branch could have already been taken in the previous stage
+        // if (state->EXMEM.aluResult == 0){ // if aluResult is 0
+        //     // fill pipline with noops so control hazard doesnt occur
+        //     newState->IFID.instr = NOOPINSTR; // set IFID instruction to NOOP
+        //     newState->IDEX.instr = NOOPINSTR; // set IDEX instruction to NOOP
+        //     newState->EXMEM.instr = NOOPINSTR; // set EXMEM instruction to NOOP
+        //     newState->pc = state->EXMEM.branchTarget; // set pc to branchTarget
+        // }
+
+        // check using eq against what fetch predicted (not taken unless configured otherwise)
+        if (!config->resolveInEx){
+            newState->stats.branches++;
+        }
+        if (!config->resolveInEx && state->EXMEM.eq != predictTaken(config, state->EXMEM.instr)){ // if eq is true
+            // fill pipline with noops so control hazard doesnt occur
+            newState->IFID.instr = NOOPINSTR; // set IFID instruction to NOOP
+            newState->IDEX.instr = NOOPINSTR; // set IDEX instruction to NOOP
+            newState->EXMEM.instr = NOOPINSTR; // set EXMEM instruction to NOOP
+            newState->pc = state->EXMEM.branchTarget; // set pc to branchTarget
+            if (!state->EXMEM.eq){ // predicted taken but wasn't: back to the instruction after it
+                newState->pc = state->EXMEM.branchTarget - convertNum(field2(state->EXMEM.instr));
+            }
+            newState->latchPc[TAG_IFID] = newState->latchPc[TAG_IDEX] = newState->latchPc[TAG_EXMEM] = -1;
+            newState->memWait = 0;
+            newState->stats.mispredicts++;
+        }
+    }
+    else if (opcode(newState->MEMWB.instr) != NOOP && opcode(newState->MEMWB.instr) != HALT){ // all instructions except noop and halt
+        newState->MEMWB.writeData = state->EXMEM.aluResult; // set writeData to aluResult
+    }
+    else{
+        newState->MEMWB.writeData = 0; // reset writeData to 0
+    }
+
+    writeBack(state, newState);
+    PROF_REGION(PROF_OTHER);
+}
+
+// End the cycle: state becomes newState. Only a SW in MEM this cycle can have
+// written dataMem, so that is the only word that needs to be carried over.
+void commitCycle(stateType *state, const stateType *newState) {
+    if (opcode(newState->MEMWB.instr) == SW){
+        int addr = state->EXMEM.aluResult;
+        state->dataMem[addr] = newState->dataMem[addr];
+    }
+    copyLatches(state, newState);
+    PROF_REGION(PROF_OTHER);
+}
+
+/* ------------------ Reference model ------------------ */
+// A plain one-instruction-at-a-time LC-2K interpreter, used as the golden
+// model the pipeline is checked against.
+
+// architectural effects of one retired instruction
+typedef struct retireStruct {
+    int pc;
+    int instr;
+    int destReg; // register written, -1 if none
+    int destVal;
+    int memAddr; // effective address of lw/sw
+    int memVal; // value stored by sw
+    int taken; // beq outcome
+} retireType;
+
+// Execute the instruction at *pc. Returns its opcode, or -1 if the pc or
+// the effective address is outside of memory.
+int funcStep(int *pc, int *reg, int *dataMem, const int *instrMem, retireType *r) {
+    if (*pc < 0 || *pc >= NUMMEMORY){
+        return -1;
+    }
+    int instr = instrMem[*pc];
+    int op = opcode(instr);
+    int regA = field0(instr);
+    int regB = field1(instr);
+    int offset = convertNum(field2(instr));
+
+    r->pc = *pc;
+    r->instr = instr;
+    r->destReg = -1;
+    r->taken = 0;
+    *pc += 1;
+
+    switch (op) {
+        case ADD:
+        case NOR:
+            r->destReg = instr & 0x7;
+            r->destVal = op == ADD ? reg[regA] + reg[regB] : ~(reg[regA] | reg[regB]);
+            reg[r->destReg] = r->destVal;
+            break;
+        case LW:
+        case SW:
+            r->memAddr = reg[regA] + offset;
+            if (r->memAddr < 0 || r->memAddr >= NUMMEMORY){
+                return -1;
+            }
+            if (op == LW){
+                r->destReg = regB;
+                r->destVal = reg[regB] = dataMem[r->memAddr];
+            }
+            else{
+                r->memVal = dataMem[r->memAddr] = reg[regB];
+            }
+            break;
+        case BEQ:
+            r->taken = reg[regA] == reg[regB];
+            if (r->taken){
+                *pc += offset;
+            }
+            break;
+        case JALR: // not implemented for Project 3, the pipeline runs it as a noop
+        case HALT:
+        case NOOP:
+        default:
+            break;
+    }
+    return op;
+}
+
+/* ------------------ Lockstep checker ----------------- */
+// Follows the pipeline cycle by cycle and checks every instruction that
+// retires from WBEND against the reference model.
+
+typedef struct cosimStruct {
+    int pc;
+    int reg[NUMREGS];
+    int dataMem[NUMMEMORY];
+    retireType mem; // outcome of the instruction that went through MEM this cycle
+    unsigned int retired; // number of instructions checked so far
+    int memTop; // dataMem is zero from here up, in both models
+    // what went wrong, for cosimReport
+    int diverged; // one of the DIVERGE_ codes below, 0 while in agreement
+    unsigned int cycle;
+    retireType ref, pipe;
+    int where, got, want;
+} cosimType;
+
+#define DIVERGE_RETIRE 1 // a retired instruction differs
+#define DIVERGE_FAULT 2 // the reference ran outside of memory
+#define DIVERGE_HALT 3 // the pipeline halted somewhere else
+#define DIVERGE_REG 4 // final register differs
+#define DIVERGE_MEM 5 // final memory word differs
+
+// Start the reference from state, whose dataMem must be zero past numMemory
+void cosimInit(cosimType *cosim, const stateType *state) {
+    int top = state->numMemory;
+    cosim->pc = state->pc;
+    memcpy(cosim->reg, state->reg, sizeof(cosim->reg));
+    memcpy(cosim->dataMem, state->dataMem, top * sizeof(int));
+    if (cosim->memTop > top){
+        memset(cosim->dataMem + top, 0, (cosim->memTop - top) * sizeof(int));
+    }
+    cosim->memTop = top;
+    cosim->retired = 0;
+    cosim->diverged = 0;
+}
+
+// Run one instruction on the reference
+int cosimStep(cosimType *cosim, const int *instrMem, retireType *r) {
+    int op = funcStep(&cosim->pc, cosim->reg, cosim->dataMem, instrMem, r);
+    if (op == SW && r->memAddr >= cosim->memTop){
+        cosim->memTop = r->memAddr + 1;
+    }
+    return op;
+}
+
+void printRetire(const char *who, const retireType *r) {
+    const char *label = symbolName(r->pc);
+    printf("\t%s: pc %d ", who, r->pc);
+    if (label){
+        printf("(%s) ", label);
+    }
+    printInstruction(r->instr);
+    if (r->destReg >= 0){
+        printf(", reg[ %d ] = %d", r->destReg, r->destVal);
+    }
+    if (opcode(r->instr) == LW || opcode(r->instr) == SW){
+        printf(", address %d", r->memAddr);
+    }
+    if (opcode(r->instr) == SW){
+        printf(", dataMem = %d", r->memVal);
+    }
+    if (opcode(r->instr) == BEQ){
+        printf(r->taken ? ", taken" : ", not taken");
+    }
+    printf("\n");
+}
+
+void cosimReport(const cosimType *cosim) {
+    switch (cosim->diverged) {
+        case DIVERGE_RETIRE:
+        case DIVERGE_FAULT:
+            printf("cosim: divergence in cycle %d at retired instruction %d\n", cosim->cycle, cosim->retired);
+            if (cosim->diverged == DIVERGE_RETIRE){
+                printRetire("reference", &cosim->ref);
+            }
+            else{
+                printf("\treference: fault at pc %d\n", cosim->ref.pc);
+            }
+            printRetire("pipeline ", &cosim->pipe);
+            break;
+        case DIVERGE_HALT:
+            printf("cosim: pipeline halted at pc %d, reference is at pc %d\n", cosim->got, cosim->want);
+            break;
+        case DIVERGE_REG:
+            printf("cosim: final reg[ %d ] = %d, reference has %d\n", cosim->where, cosim->got, cosim->want);
+            break;
+        case DIVERGE_MEM:
+            printf("cosim: final dataMem[ %d ] = %d, reference has %d\n", cosim->where, cosim->got, cosim->want);
+            break;
+    }
+}
+
+int sameRetire(const retireType *a, const retireType *b) {
+    int op = opcode(a->instr);
+    if (a->pc != b->pc || a->instr != b->instr || a->destReg != b->destReg){
+        return 0;
+    }
+    if (a->destReg >= 0 && a->destVal != b->destVal){
+        return 0;
+    }
+    if ((op == LW || op == SW) && a->memAddr != b->memAddr){
+        return 0;
+    }
+    if (op == SW && a->memVal != b->memVal){
+        return 0;
+    }
+    return op != BEQ || a->taken == b->taken;
+}
+
+// Call after runCycle(state, newState). Returns nonzero on divergence.
+int cosimCycle(cosimType *cosim, const stateType *state, const stateType *newState) {
+    // the instruction leaving MEMWB is older than the one entering it, so
+    // retire it first, using what was captured when it went through MEM
+    if (newState->latchPc[TAG_WBEND] >= 0){
+        retireType *pipe = &cosim->pipe;
+        int op = opcode(newState->WBEND.instr);
+        *pipe = cosim->mem;
+        pipe->pc = newState->latchPc[TAG_WBEND];
+        pipe->instr = newState->WBEND.instr;
+        pipe->destReg = -1;
+        if (op == ADD || op == NOR){
+            pipe->destReg = field2(pipe->instr);
+            pipe->destVal = newState->WBEND.writeData;
+        }
+        if (op == LW){
+            pipe->destReg = field1(pipe->instr);
+            pipe->destVal = newState->WBEND.writeData;
+        }
+        cosim->ref.pc = cosim->pc;
+        if (cosimStep(cosim, state->instrMem, &cosim->ref) < 0){
+            cosim->diverged = DIVERGE_FAULT;
+        }
+        else if (!sameRetire(&cosim->ref, pipe)){
+            cosim->diverged = DIVERGE_RETIRE;
+        }
+        if (cosim->diverged){
+            cosim->cycle = state->cycles;
+            return 1;
+        }
+        cosim->retired++;
+    }
+    if (newState->latchPc[TAG_MEMWB] >= 0){
+        cosim->mem.memAddr = state->EXMEM.aluResult;
+        cosim->mem.memVal = state->EXMEM.valB;
+        cosim->mem.taken = state->EXMEM.eq;
+    }
+    return 0;
+}
+
+// Call once the pipeline has halted: the reference must be at the same halt
+// with the same registers and memory. Returns nonzero on divergence.
+int cosimHalt(cosimType *cosim, const stateType *state) {
+    retireType ref;
+    int pc = cosim->pc;
+    if (cosimStep(cosim, state->instrMem, &ref) != HALT
+            || pc != state->latchPc[TAG_MEMWB]){
+        cosim->diverged = DIVERGE_HALT;
+        cosim->got = state->latchPc[TAG_MEMWB];
+        cosim->want = pc;
+        return 1;
+    }
+    for (int i = 0; i < NUMREGS; i++){
+        if (cosim->reg[i] != state->reg[i]){
+            cosim->diverged = DIVERGE_REG;
+            cosim->where = i;
+            cosim->got = state->reg[i];
+            cosim->want = cosim->reg[i];
+            return 1;
+        }
+    }
+    // every store was checked, so the pipeline hasn't written past memTop either
+    for (int i = 0; i < cosim->memTop; i++){
+        if (cosim->dataMem[i] != state->dataMem[i]){
+            cosim->diverged = DIVERGE_MEM;
+            cosim->where = i;
+            cosim->got = state->dataMem[i];
+            cosim->want = cosim->dataMem[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* ------------------- Option strings ------------------ */
+// Modes take their settings as one "key=value,key=value" argument.
+
+// Returns a pointer to the value of key in spec, or NULL if it isn't there
+const char *specFind(const char *spec, const char *key) {
+    size_t len = strlen(key);
+    while (spec && *spec) {
+        if (strncmp(spec, key, len) == 0 && spec[len] == '='){
+            return spec + len + 1;
+        }
+        spec = strchr(spec, ',');
+        if (spec){
+            spec++;
+        }
+    }
+    return NULL;
+}
+
+long specValue(const char *spec, const char *key, long def) {
+    const char *value = specFind(spec, key);
+    return value ? strtol(value, NULL, 0) : def;
+}
+
+// Exit with an error if spec has a key that isn't in the comma separated list keys
+void specCheck(const char *spec, const char *keys) {
+    while (spec && *spec) {
+        size_t len = strcspn(spec, "=,");
+        const char *k = keys;
+        while (k && !(strncmp(k, spec, len) == 0 && (k[len] == ',' || k[len] == '\0'))) {
+            k = strchr(k, ',');
+            k = k ? k + 1 : NULL;
+        }
+        if (!k || spec[len] != '='){
+            printf("error: bad option '%.*s', expected one of %s\n", (int)len, spec, keys);
+            exit(1);
+        }
+        spec = strchr(spec, ',');
+        if (spec){
+            spec++;
+        }
+    }
+}
+
+/* ------------------ Pipeline configs ----------------- */
+
+#define CONFIG_KEYS "mem,early,predict,resolve"
+
+static const char *predictNames[] = { "nt", "bt", "t" };
+static const char *resolveNames[] = { "mem", "ex" };
+
+// Set one config field from the text in value, up to the next ',' or '/'.
+// Returns nonzero if the text isn't something key takes.
+int configSet(configType *config, const char *key, const char *value) {
+    size_t len = strcspn(value, ",/");
+    char *end;
+    if (strcmp(key, "mem") == 0 || strcmp(key, "early") == 0){
+        long n = strtol(value, &end, 0);
+        long max = strcmp(key, "mem") == 0 ? 1000 : 1; // early is a flag
+        if (end != value + len || len == 0 || n < 0 || n > max){
+            return 1;
+        }
+        *(strcmp(key, "mem") == 0 ? &config->memLatency : &config->earlyLoad) = n;
+        return 0;
+    }
+    const char **names = strcmp(key, "predict") == 0 ? predictNames : resolveNames;
+    int count = strcmp(key, "predict") == 0 ? 3 : 2;
+    for (int i = 0; i < count; i++){
+        if (strlen(names[i]) == len && strncmp(value, names[i], len) == 0){
+            *(names == predictNames ? &config->predict : &config->resolveInEx) = i;
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Read a config from "mem=2,early=1,predict=bt,resolve=ex", all optional
+void configParse(configType *config, const char *spec) {
+    static const char *keys[] = { "mem", "early", "predict", "resolve" };
+    *config = defaultConfig;
+    for (int i = 0; i < 4; i++){
+        const char *value = specFind(spec, keys[i]);
+        // a list of values is only for -sweep
+        if (value && (configSet(config, keys[i], value) || value[strcspn(value, ",/")] == '/')){
+            printf("error: bad value for %s, expected %s\n", keys[i],
+                i == 0 ? "a number up to 1000" : i == 1 ? "0 or 1" : i == 2 ? "nt, bt or t" : "mem or ex");
+            exit(1);
+        }
+    }
+}
+
+double wallTime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline int encode(int op, int regA, int regB, int offset) {
+    return (op << 22) | (regA << 19) | (regB << 16) | (offset & 0xFFFF);
+}
+
+/* --------------------- Assembler --------------------- */
+// Assembles LC-2K source (.as, .s or .lc2k) straight into memory in one
+// pass: labels go into a hash table, and uses of labels that aren't defined
+// yet are remembered and patched at the end. The labels stay in the table
+// so that reports can name addresses.
+
+#define MAXLABEL 6 // longest label the language allows
+#define SYMBOLBITS 17 // the table has room for twice as many labels as there are words
+
+typedef struct symbolStruct {
+    char name[MAXLABEL + 1]; // empty for a free slot
+    int addr; // -1 while only used, not yet defined
+    int line; // of the definition, or the first use
+} symbolType;
+
+typedef struct fixupStruct {
+    int addr; // word to patch
+    int symbol;
+    int line;
+    int fill; // the whole word is the address, not a 16 bit offset
+} fixupType;
+
+typedef struct asmStruct {
+    const char *filename;
+    symbolType symbols[1 << SYMBOLBITS];
+    int used[NUMMEMORY]; // slots in use, so that they can be cleared quickly
+    int numSymbols;
+    int labelAt[NUMMEMORY]; // slot + 1 of the label at each address, 0 for none
+    fixupType fixups[NUMMEMORY];
+    int numFixups;
+} asmType;
+
+static asmType assembler;
+
+int isAssembly(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    return dot && (strcmp(dot, ".as") == 0 || strcmp(dot, ".s") == 0 || strcmp(dot, ".lc2k") == 0);
+}
+
+void asmError(int line, const char *message, const char *detail) {
+    printf("error: %s:%d: %s%s\n", assembler.filename, line, message, detail);
+    exit(1);
+}
+
+// Find name's slot, adding it (undefined) if it isn't there yet
+int symbolFind(const char *name, int line) {
+    unsigned int hash = 2166136261u; // FNV-1a
+    for (const char *c = name; *c; c++){
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    unsigned int mask = (1 << SYMBOLBITS) - 1;
+    for (unsigned int slot = hash & mask; ; slot = (slot + 1) & mask) {
+        symbolType *s = &assembler.symbols[slot];
+        if (s->name[0] == '\0'){
+            if (assembler.numSymbols == NUMMEMORY){
+                asmError(line, "too many labels", "");
+            }
+            strcpy(s->name, name);
+            s->addr = -1;
+            s->line = line;
+            assembler.used[assembler.numSymbols++] = slot;
+            return slot;
+        }
+        if (strcmp(s->name, name) == 0){
+            return slot;
+        }
+    }
+}
+
+// Label at addr in the last program assembled, NULL if there is none
+const char *symbolName(int addr) {
+    if (addr < 0 || addr >= NUMMEMORY || !assembler.labelAt[addr]){
+        return NULL;
+    }
+    return assembler.symbols[assembler.labelAt[addr] - 1].name;
+}
+
+// Address of a label in the last program assembled, -1 if there is none
+int symbolAddr(const char *name) {
+    for (int i = 0; i < assembler.numSymbols; i++){
+        const symbolType *s = &assembler.symbols[assembler.used[i]];
+        if (strcmp(s->name, name) == 0){
+            return s->addr;
+        }
+    }
+    return -1;
+}
+
+int isLabel(const char *token) {
+    int length = strlen(token);
+    if (length > MAXLABEL || !((token[0] >= 'a' && token[0] <= 'z') || (token[0] >= 'A' && token[0] <= 'Z'))){
+        return 0;
+    }
+    for (int i = 1; i < length; i++){
+        char c = token[i];
+        if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9'))){
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Parse a whole decimal number into *value, returns 0 if token isn't one
+int asmNumber(const char *token, long *value) {
+    char *end;
+    *value = strtol(token, &end, 10);
+    return end != token && *end == '\0';
+}
+
+int asmRegister(const char *token, int line) {
+    long reg;
+    if (!token || !asmNumber(token, &reg) || reg < 0 || reg >= NUMREGS){
+        asmError(line, "bad register ", token ? token : "(missing)");
+    }
+    return reg;
+}
+
+// Value of a number or label field. A label that isn't defined yet gives 0
+// and a fixup for the word at addr.
+long asmValue(const char *token, int addr, int line, int *defined) {
+    long value;
+    *defined = 1;
+    if (!token){
+        asmError(line, "missing field", "");
+    }
+    if (asmNumber(token, &value)){
+        return value;
+    }
+    if (!isLabel(token)){
+        asmError(line, "bad number or label ", token);
+    }
+    int slot = symbolFind(token, line);
+    if (assembler.symbols[slot].addr >= 0){
+        return assembler.symbols[slot].addr;
+    }
+    fixupType *f = &assembler.fixups[assembler.numFixups++];
+    f->addr = addr;
+    f->symbol = slot;
+    f->line = line;
+    f->fill = 0;
+    *defined = 0;
+    return 0;
+}
+
+// Put a 16 bit offset field into word, a beq label is relative to addr + 1
+int asmOffset(int word, long value, int isLabel, int addr, int line) {
+    if (isLabel && opcode(word) == BEQ){
+        value -= addr + 1;
+    }
+    if (value < -32768 || value > 32767){
+        asmError(line, "offset out of range", "");
+    }
+    return word | (value & 0xFFFF);
+}
+
+// Assemble filename into image, returns the number of words
+int assemble(const char *filename, int *image) {
+    char text[MAXLINELENGTH];
+    int numWords = 0, line = 0;
+    FILE *filePtr = fopen(filename, "r");
+    if (filePtr == NULL) {
+        printf("error: can't open file %s\n", filename);
+        exit(1);
+    }
+
+    for (int i = 0; i < assembler.numSymbols; i++){
+        symbolType *s = &assembler.symbols[assembler.used[i]];
+        if (s->addr >= 0){
+            assembler.labelAt[s->addr] = 0;
+        }
+        s->name[0] = '\0';
+    }
+    assembler.numSymbols = assembler.numFixups = 0;
+    assembler.filename = filename;
+
+    while (fgets(text, MAXLINELENGTH, filePtr) != NULL) {
+        char *tokens[5];
+        int numTokens = 0, hasLabel = text[0] != ' ' && text[0] != '\t';
+        line++;
+        for (char *c = text; numTokens < 5; ){
+            while (*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n'){
+                c++;
+            }
+            if (*c == '\0'){
+                break;
+            }
+            tokens[numTokens++] = c;
+            while (*c && *c != ' ' && *c != '\t' && *c != '\r' && *c != '\n'){
+                c++;
+            }
+            if (*c){
+                *c++ = '\0';
+            }
+        }
+        if (numTokens == 0){
+            continue; // blank line
+        }
+        while (numTokens < 5){
+            tokens[numTokens++] = NULL;
+        }
+        if (numWords == NUMMEMORY){
+            asmError(line, "program too big", "");
+        }
+
+        char **fields = tokens + hasLabel;
+        if (hasLabel){
+            if (!isLabel(tokens[0])){
+                asmError(line, "bad label ", tokens[0]);
+            }
+            int slot = symbolFind(tokens[0], line);
+            if (assembler.symbols[slot].addr >= 0){
+                asmError(line, "duplicate label ", tokens[0]);
+            }
+            assembler.symbols[slot].addr = numWords;
+            assembler.symbols[slot].line = line;
+            assembler.labelAt[numWords] = slot + 1;
+        }
+        if (!fields[0]){
+            asmError(line, "missing opcode", "");
+        }
+
+        int op = 0, word, defined;
+        while (op <= NOOP && strcmp(fields[0], opcode_to_str_map[op]) != 0){
+            op++;
+        }
+        if (strcmp(fields[0], ".fill") == 0){
+            word = asmValue(fields[1], numWords, line, &defined);
+            if (!defined){
+                assembler.fixups[assembler.numFixups - 1].fill = 1;
+            }
+        }
+        else if (op > NOOP){
+            asmError(line, "unknown opcode ", fields[0]);
+        }
+        else if (op == ADD || op == NOR){
+            word = (op << 22) | (asmRegister(fields[1], line) << 19) | (asmRegister(fields[2], line) << 16)
+                | asmRegister(fields[3], line);
+        }
+        else if (op == LW || op == SW || op == BEQ){
+            word = (op << 22) | (asmRegister(fields[1], line) << 19) | (asmRegister(fields[2], line) << 16);
+            long value, label = fields[3] && !asmNumber(fields[3], &value);
+            value = asmValue(fields[3], numWords, line, &defined);
+            if (defined){
+                word = asmOffset(word, value, label, numWords, line);
+            }
+        }
+        else if (op == JALR){
+            word = (op << 22) | (asmRegister(fields[1], line) << 19) | (asmRegister(fields[2], line) << 16);
+        }
+        else{
+            word = op << 22;
+        }
+        image[numWords++] = word;
+    }
+    fclose(filePtr);
+
+    for (int i = 0; i < assembler.numFixups; i++){
+        const fixupType *f = &assembler.fixups[i];
+        const symbolType *s = &assembler.symbols[f->symbol];
+        if (s->addr < 0){
+            asmError(f->line, "undefined label ", s->name);
+        }
+        if (f->fill){
+            image[f->addr] = s->addr;
+        }
+        else{
+            image[f->addr] = asmOffset(image[f->addr], s->addr, 1, f->addr, f->line);
+        }
+    }
+    return numWords;
+}
+
+// Load a program into state, assembling it first if it is assembly, and
+// print the same listing readMachineCode does
+void loadProgram(stateType *state, char *filename) {
+    if (!isAssembly(filename)){
+        readMachineCode(state, filename);
+        return;
+    }
+    state->numMemory = assemble(filename, state->instrMem);
+    printf("instruction memory:\n");
+    for (unsigned int i = 0; i < state->numMemory; i++){
+        printf("\tinstrMem[ %d ]\t= 0x%08x\t= %d\t= ", i, state->instrMem[i], state->instrMem[i]);
+        printInstruction(state->dataMem[i] = state->instrMem[i]);
+        printf("\n");
+    }
+}
+
+/* ----------------- Program generator ----------------- */
+// Generates random programs that always halt: the only backward branches
+// close loops with a trip count of at most GEN_MAXTRIP, everything else
+// branches forward within its own block.
+
+typedef struct genStruct {
+    unsigned long long seed;
+    int length; // roughly how many instructions
+    int raw; // % of source registers that read a recent destination
+    int loadUse; // % of loads directly followed by a use of the loaded register
+    int branch; // % of instructions that are forward branches
+    int taken; // % of those that compare a register with itself
+    int alias; // % of stores directly followed by a load of the same word
+    int loop; // % of blocks that are loops
+} genType;
+
+#define GEN_KEYS "seed,len,raw,loaduse,branch,taken,alias,loop"
+
+// Data lives right after the jump at address 0, so every word can be reached
+// with a 16 bit offset from reg 0 however long the program gets.
+#define GEN_NEG1 1 // -1, kept in reg 6
+#define GEN_INIT 2 // starting values of regs 1-5
+#define GEN_SCRATCH 7 // words the loads and stores go to
+#define GEN_NUMSCRATCH 16
+#define GEN_TRIP (GEN_SCRATCH + GEN_NUMSCRATCH) // the numbers 1 to GEN_MAXTRIP
+#define GEN_MAXTRIP 8
+#define GEN_CODE (GEN_TRIP + GEN_MAXTRIP) // first instruction
+#define GEN_COUNTER 7 // loop counter register
+
+void genParse(genType *gen, const char *spec) {
+    gen->seed = specValue(spec, "seed", 1);
+    gen->length = specValue(spec, "len", 100);
+    gen->raw = specValue(spec, "raw", 40);
+    gen->loadUse = specValue(spec, "loaduse", 30);
+    gen->branch = specValue(spec, "branch", 10);
+    gen->taken = specValue(spec, "taken", 50);
+    gen->alias = specValue(spec, "alias", 30);
+    gen->loop = specValue(spec, "loop", 30);
+    if (gen->length < 1 || gen->length > NUMMEMORY - GEN_CODE - 64){
+        printf("error: len must be between 1 and %d\n", NUMMEMORY - GEN_CODE - 64);
+        exit(1);
+    }
+}
+
+typedef struct genBuildStruct {
+    const genType *gen;
+    unsigned long long rng;
+    int *image;
+    int n; // words emitted so far
+    int recent[2]; // last two destination registers
+} genBuildType;
+
+unsigned long long nextRandom(unsigned long long *rng) {
+    // xorshift64*
+    *rng ^= *rng >> 12;
+    *rng ^= *rng << 25;
+    *rng ^= *rng >> 27;
+    return *rng * 0x2545F4914F6CDD1DULL;
+}
+
+int genRandom(genBuildType *b, int n) {
+    return nextRandom(&b->rng) % n;
+}
+
+int genChance(genBuildType *b, int percent) {
+    return genRandom(b, 100) < percent;
+}
+
+// A register to write: never reg 0 (the base of every address), 6 or 7
+int genDest(genBuildType *b) {
+    int reg = 1 + genRandom(b, 5);
+    b->recent[1] = b->recent[0];
+    b->recent[0] = reg;
+    return reg;
+}
+
+int genSource(genBuildType *b) {
+    if (genChance(b, b->gen->raw)){
+        return b->recent[genRandom(b, 2)];
+    }
+    return genRandom(b, NUMREGS);
+}
+
+void genEmit(genBuildType *b, int word) {
+    b->image[b->n++] = word;
+}
+
+void genAlu(genBuildType *b, int source) {
+    int op = genRandom(b, 2) ? ADD : NOR;
+    int regA = source >= 0 ? source : genSource(b);
+    int regB = genSource(b);
+    if (genRandom(b, 2)){
+        int t = regA;
+        regA = regB;
+        regB = t;
+    }
+    genEmit(b, encode(op, regA, regB, genDest(b)));
+}
+
+// Emit count straight-line instructions with forward branches inside them
+void genBlock(genBuildType *b, int count) {
+    int end = b->n + count;
+    while (b->n < end) {
+        int left = end - b->n;
+        int kind = genRandom(b, 100);
+        if (left > 1 && genChance(b, b->gen->branch)){
+            int skip = 1 + genRandom(b, left - 1 < 3 ? left - 1 : 3);
+            int regA = genRandom(b, NUMREGS);
+            int regB = genChance(b, b->gen->taken) ? regA : genRandom(b, NUMREGS);
+            genEmit(b, encode(BEQ, regA, regB, skip));
+        }
+        else if (kind < 20){
+            int dest = genDest(b);
+            genEmit(b, encode(LW, 0, dest, GEN_SCRATCH + genRandom(b, GEN_NUMSCRATCH)));
+            if (left > 1 && genChance(b, b->gen->loadUse)){
+                genAlu(b, dest);
+            }
+        }
+        else if (kind < 35){
+            int slot = GEN_SCRATCH + genRandom(b, GEN_NUMSCRATCH);
+            genEmit(b, encode(SW, 0, genSource(b), slot));
+            if (left > 1 && genChance(b, b->gen->alias)){
+                genEmit(b, encode(LW, 0, genDest(b), slot));
+            }
+        }
+        else if (kind < 38){
+            genEmit(b, NOOPINSTR);
+        }
+        else{
+            genAlu(b, -1);
+        }
+    }
+}
+
+// Fill image with a program, returns its length in words
+int generate(const genType *gen, int *image) {
+    genBuildType b = { gen, 0, image, 0, { 1, 2 } };
+    // splitmix64 so that neighbouring seeds give unrelated programs
+    b.rng = gen->seed + 0x9E3779B97F4A7C15ULL;
+    b.rng = (b.rng ^ (b.rng >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    b.rng = (b.rng ^ (b.rng >> 27)) * 0x94D049BB133111EBULL;
+    b.rng ^= b.rng >> 31;
+    if (b.rng == 0){
+        b.rng = 1;
+    }
+
+    genEmit(&b, encode(BEQ, 0, 0, GEN_CODE - 1));
+    genEmit(&b, -1);
+    for (int i = 0; i < 5; i++){
+        // one draw per statement, so the order is the same under any compiler
+        unsigned int bits = nextRandom(&b.rng);
+        int shift = genRandom(&b, 32);
+        genEmit(&b, (int)(bits >> shift));
+    }
+    for (int i = 0; i < GEN_NUMSCRATCH; i++){
+        genEmit(&b, genRandom(&b, 1000) - 500);
+    }
+    for (int i = 1; i <= GEN_MAXTRIP; i++){
+        genEmit(&b, i);
+    }
+
+    genEmit(&b, encode(LW, 0, 6, GEN_NEG1));
+    for (int i = 0; i < 5; i++){
+        genEmit(&b, encode(LW, 0, i + 1, GEN_INIT + i));
+    }
+    while (b.n < GEN_CODE + gen->length) {
+        int count = 3 + genRandom(&b, 10);
+        if (genChance(&b, gen->loop)){
+            int trip = 1 + genRandom(&b, GEN_MAXTRIP);
+            int top;
+            genEmit(&b, encode(LW, 0, GEN_COUNTER, GEN_TRIP + trip - 1));
+            top = b.n;
+            genBlock(&b, count);
+            genEmit(&b, encode(ADD, GEN_COUNTER, 6, GEN_COUNTER));
+            genEmit(&b, encode(BEQ, GEN_COUNTER, 0, 1));
+            genEmit(&b, encode(BEQ, 0, 0, top - (b.n + 1)));
+        }
+        else{
+            genBlock(&b, count);
+        }
+    }
+    genEmit(&b, HALT << 22);
+    return b.n;
+}
+
+/* ------------------- Fuzzing driver ------------------ */
+// Runs generated programs through the pipeline with the lockstep checker,
+// spread over host threads, and shrinks every program that diverges.
+
+typedef struct fuzzWorkStruct {
+    stateType state, newState;
+    cosimType cosim;
+    int image[NUMMEMORY];
+    int memTop; // state and newState memories are zero from here up
+    const configType *config;
+    unsigned long long cycles; // simulated by this thread
+} fuzzWorkType;
+
+typedef struct fuzzStruct {
+    genType gen;
+    configType config;
+    long count; // programs to run
+    long next; // next program to hand out
+    long failures, skipped;
+    unsigned long long cycles;
+    pthread_mutex_t lock;
+} fuzzType;
+
+#define FUZZ_MAXINSTRS 10000000 // the generator can't get anywhere near this
+
+// Load the program in w->image. Only the words the last program could have
+// touched get cleared, which matters when programs run a few hundred cycles.
+void fuzzLoad(fuzzWorkType *w, int numWords) {
+    stateType *states[2] = { &w->state, &w->newState };
+    for (int i = 0; i < 2; i++){
+        memcpy(states[i]->instrMem, w->image, numWords * sizeof(int));
+        memcpy(states[i]->dataMem, w->image, numWords * sizeof(int));
+        if (w->memTop > numWords){
+            memset(states[i]->instrMem + numWords, 0, (w->memTop - numWords) * sizeof(int));
+            memset(states[i]->dataMem + numWords, 0, (w->memTop - numWords) * sizeof(int));
+        }
+        states[i]->numMemory = numWords;
+    }
+    w->memTop = numWords;
+    resetState(&w->state);
+    copyLatches(&w->newState, &w->state);
+}
+
+// Run image through the pipeline under the checker.
+// Returns 0 if they agree, 1 on divergence and -1 if the program is no good
+// (the reference faults or doesn't halt, or the pipeline doesn't halt).
+int fuzzRun(fuzzWorkType *w, int numWords) {
+    const configType *config = w->config;
+    stateType *state = &w->state;
+    stateType *newState = &w->newState;
+    retireType r;
+    unsigned long long instrs = 0;
+    int op;
+
+    fuzzLoad(w, numWords);
+    cosimInit(&w->cosim, state);
+    while ((op = cosimStep(&w->cosim, state->instrMem, &r)) != HALT) {
+        if (op < 0 || ++instrs > FUZZ_MAXINSTRS){
+            return -1;
+        }
+    }
+
+    cosimInit(&w->cosim, state);
+    // a pipeline that has gone wrong may have written anywhere
+    w->memTop = NUMMEMORY;
+    while (opcode(state->MEMWB.instr) != HALT) {
+        if (state->cycles > (8 + config->memLatency) * instrs + 100){
+            return -1;
+        }
+        runCycle(config, state, newState);
+        if (cosimCycle(&w->cosim, state, newState)){
+            return 1;
+        }
+        commitCycle(state, newState);
+    }
+    w->cycles += state->cycles;
+    if (cosimHalt(&w->cosim, state)){
+        return 1;
+    }
+    w->memTop = w->cosim.memTop;
+    return 0;
+}
+
+// Shrink a diverging program by turning ever smaller runs of words into
+// noops, keeping each change that still diverges. Nothing moves, so branch
+// offsets and addresses stay valid. Returns the number of words left that
+// aren't noops.
+int fuzzMinimize(fuzzWorkType *w, int numWords) {
+    static const int noop = NOOPINSTR;
+    int saved[16];
+    int left = 0;
+    for (int size = 16; size >= 1; size /= 2) {
+        for (int start = 0; start < numWords; start += size) {
+            int len = start + size <= numWords ? size : numWords - start;
+            int changed = 0;
+            for (int i = 0; i < len; i++){
+                saved[i] = w->image[start + i];
+                changed |= saved[i] != noop;
+                w->image[start + i] = noop;
+            }
+            if (changed && fuzzRun(w, numWords) != 1){
+                memcpy(w->image + start, saved, len * sizeof(int));
+            }
+        }
+    }
+    fuzzRun(w, numWords); // leave the report of the final version in w->cosim
+    for (int i = 0; i < numWords; i++){
+        left += w->image[i] != noop;
+    }
+    return left;
+}
+
+void *fuzzThread(void *arg) {
+    fuzzType *fuzz = arg;
+    fuzzWorkType *w = calloc(1, sizeof(fuzzWorkType));
+    if (!w){
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    w->config = &fuzz->config;
+    for (;;) {
+        long i;
+        int numWords, result;
+        genType gen = fuzz->gen;
+
+        pthread_mutex_lock(&fuzz->lock);
+        i = fuzz->next++;
+        pthread_mutex_unlock(&fuzz->lock);
+        if (i >= fuzz->count){
+            break;
+        }
+
+        gen.seed += i;
+        numWords = generate(&gen, w->image);
+        result = fuzzRun(w, numWords);
+        if (result == 1){
+            char name[64];
+            int left = fuzzMinimize(w, numWords);
+            FILE *out;
+            snprintf(name, sizeof(name), "fuzz-%llu.mc", gen.seed);
+            out = fopen(name, "w");
+            for (int j = 0; out && j < numWords; j++){
+                fprintf(out, "%d\n", w->image[j]);
+            }
+            if (out){
+                fclose(out);
+            }
+            pthread_mutex_lock(&fuzz->lock);
+            printf("fuzz: seed %llu diverged, minimized to %d words, written to %s\n", gen.seed, left, name);
+            cosimReport(&w->cosim);
+            fuzz->failures++;
+            pthread_mutex_unlock(&fuzz->lock);
+        }
+        else if (result < 0){
+            pthread_mutex_lock(&fuzz->lock);
+            fuzz->skipped++;
+            pthread_mutex_unlock(&fuzz->lock);
+        }
+    }
+    pthread_mutex_lock(&fuzz->lock);
+    fuzz->cycles += w->cycles;
+    pthread_mutex_unlock(&fuzz->lock);
+    free(w);
+    return NULL;
+}
+
+int fuzzMain(const char *spec) {
+    static fuzzType fuzz;
+    long jobs = specValue(spec, "jobs", sysconf(_SC_NPROCESSORS_ONLN));
+    pthread_t threads[256];
+    double start;
+
+    specCheck(spec, GEN_KEYS "," CONFIG_KEYS ",n,jobs");
+    genParse(&fuzz.gen, spec);
+    configParse(&fuzz.config, spec);
+    fuzz.count = specValue(spec, "n", 1000);
+    if (jobs < 1){
+        jobs = 1;
+    }
+    if (jobs > 256){
+        jobs = 256;
+    }
+    pthread_mutex_init(&fuzz.lock, NULL);
+
+    start = wallTime();
+    for (long i = 0; i < jobs; i++){
+        pthread_create(&threads[i], NULL, fuzzThread, &fuzz);
+    }
+    for (long i = 0; i < jobs; i++){
+        pthread_join(threads[i], NULL);
+    }
+    double secs = wallTime() - start;
+
+    printf("fuzz: %ld programs, %ld diverged, %ld skipped, %ld threads, %.2f s\n",
+        fuzz.count, fuzz.failures, fuzz.skipped, jobs, secs);
+    printf("fuzz: %.0f programs/s, %.2f M simulated cycles/s\n",
+        fuzz.count / secs, fuzz.cycles / secs / 1e6);
+    return fuzz.failures != 0;
+}
+
+// Print a generated program as machine code
+int genMain(const char *spec) {
+    static int image[NUMMEMORY];
+    genType gen;
+    specCheck(spec, GEN_KEYS);
+    genParse(&gen, spec);
+    int numWords = generate(&gen, image);
+    for (int i = 0; i < numWords; i++){
+        printf("%d\n", image[i]);
+    }
+    return 0;
+}
+
+/* ---------------------- Run loops -------------------- */
+
+// Run the pipeline until it halts or maxCycles more cycles have run.
+// Prints each state first if trace is set, and checks every cycle against
+// cosim unless it is NULL. Returns 1 once halted, 0 if stopped early and
+// -1 on divergence.
+int simulate(const configType *config, stateType *state, stateType *newState,
+        int trace, cosimType *cosim, unsigned int maxCycles) {
+    unsigned int stop = state->cycles + maxCycles;
+    while (opcode(state->MEMWB.instr) != HALT) {
+        if (state->cycles == stop){
+            return 0;
+        }
+        if (trace){
+            PROF_REGION(PROF_PRINT);
+            printState(state);
+            PROF_REGION(PROF_OTHER);
+        }
+
+        runCycle(config, state, newState);
+        if (cosim && cosimCycle(cosim, state, newState)){
+            return -1;
+        }
+
+        /* ------------------------ END ------------------------ */
+        commitCycle(state, newState); /* this is the last statement before end of the loop. It marks the end
+        of the cycle and updates the current state with the values calculated in this cycle */
+    }
+    return cosim && cosimHalt(cosim, state) ? -1 : 1;
+}
+
+// Run state's program on the reference model, without any pipeline.
+// Returns the number of instructions executed, halt included.
+unsigned long long funcRun(stateType *state) {
+    unsigned long long instrs = 0;
+    retireType r;
+    int op;
+    do {
+        op = funcStep(&state->pc, state->reg, state->dataMem, state->instrMem, &r);
+        if (op < 0){
+            printf("error: address out of range at pc %d\n", r.pc);
+            exit(1);
+        }
+        instrs++;
+    } while (op != HALT);
+    return instrs;
+}
+
+// Read a machine code file into image without printing it. Returns the
+// number of words.
+int readImage(const char *filename, int *image) {
+    char line[MAXLINELENGTH];
+    int numWords = 0;
+    if (isAssembly(filename)){
+        return assemble(filename, image);
+    }
+    FILE *filePtr = fopen(filename, "r");
+    if (filePtr == NULL) {
+        printf("error: can't open file %s\n", filename);
+        exit(1);
+    }
+    while (fgets(line, MAXLINELENGTH, filePtr) != NULL) {
+        if (numWords == NUMMEMORY || sscanf(line, "%d", image + numWords) != 1) {
+            printf("error in reading address %d\n", numWords);
+            exit(1);
+        }
+        numWords++;
+    }
+    fclose(filePtr);
+    return numWords;
+}
+
+/* ------------------ Loop fast-forward ----------------- */
+// With -q -l, loops whose timing has settled are run on the reference model
+// and their cycles added up instead of simulated. Every branch that squashes
+// in MEM leaves the pipeline in the same shape: the branch in MEM/WB,
+// bubbles behind it and the pc at its target. From there on, the timing
+// depends only on the path the program takes. So when the stretch between
+// two squashes of the same branch retires the same pcs in the same number of
+// cycles twice in a row, each further iteration that follows that path
+// costs the same cycles. Iterations are checked one by one on the reference
+// model, with an undo log. The first one that leaves the path is undone and
+// simulated in full, so everything printed stays exact.
+//
+// Only squashes mark iterations, so a loop is skipped only if some branch
+// in it mispredicts every time around. With resolve=ex nothing squashes in
+// MEM and nothing is skipped. With predict=bt or predict=t a back edge is
+// predicted right, so a loop whose other branches all predict right runs
+// in full too.
+
+#define LOOP_TABLEBITS 10
+#define LOOP_PRIME 0x100000001B3ULL // for the hash of the pcs retired
+
+typedef struct loopEntryStruct {
+    int branch, before; // pc of the branch that squashed and of the instruction ahead of it, -1/-1 if free
+    unsigned int cycle; // at this squash last time
+    unsigned long long retired, hash;
+    statsType stats;
+    int haveIter; // the last iteration below is known
+    unsigned int iterCycles;
+    unsigned long long iterRetired, iterHash;
+} loopEntryType;
+
+typedef struct loopStruct {
+    loopEntryType table[1 << LOOP_TABLEBITS];
+    unsigned long long retired; // instructions retired so far
+    unsigned long long hash; // of their pcs, hash * LOOP_PRIME + pc + 1 each
+    unsigned long long skippedCycles, iterations;
+    int (*undo)[2]; // address and old value of each store this iteration
+    long undoSize;
+} loopType;
+
+unsigned long long loopPower(unsigned long long n) {
+    unsigned long long result = 1, base = LOOP_PRIME;
+    for (; n; n >>= 1, base *= base){
+        if (n & 1){
+            result *= base;
+        }
+    }
+    return result;
+}
+
+// Run iterations of e's loop on the reference model from state's squash,
+// stopping before the first that doesn't take e's path. Returns how many
+// were taken.
+unsigned long long loopSkip(loopType *loop, const loopEntryType *e, stateType *state, stateType *newState) {
+    unsigned long long count = 0;
+    int target = state->pc;
+    retireType r;
+    for (;;) {
+        int saved[NUMREGS];
+        long numUndo = 0;
+        int pc = target, ok = 1;
+        unsigned long long hash = e->branch + 1;
+        memcpy(saved, state->reg, sizeof(saved));
+        for (unsigned long long i = 0; i < e->iterRetired && ok; i++) {
+            int instr = state->instrMem[pc];
+            if (opcode(instr) == HALT){
+                ok = 0;
+                break;
+            }
+            if (opcode(instr) == SW){
+                int addr = state->reg[field0(instr)] + convertNum(field2(instr));
+                if (addr >= 0 && addr < NUMMEMORY){
+                    if (numUndo == loop->undoSize){
+                        loop->undoSize = loop->undoSize ? loop->undoSize * 2 : 1024;
+                        loop->undo = realloc(loop->undo, loop->undoSize * sizeof(*loop->undo));
+                        if (!loop->undo){
+                            printf("error: out of memory\n");
+                            exit(1);
+                        }
+                    }
+                    loop->undo[numUndo][0] = addr;
+                    loop->undo[numUndo++][1] = state->dataMem[addr];
+                }
+            }
+            int op = funcStep(&pc, state->reg, state->dataMem, state->instrMem, &r);
+            if (op < 0){
+                ok = 0;
+                break;
+            }
+            if (op == SW){
+                newState->dataMem[r.memAddr] = r.memVal;
+            }
+            if (i + 1 < e->iterRetired){
+                hash = hash * LOOP_PRIME + r.pc + 1;
+            }
+            else{
+                ok = r.pc == e->branch;
+            }
+        }
+        if (!ok || hash != e->iterHash || pc != target){
+            memcpy(state->reg, saved, sizeof(saved));
+            while (numUndo--) {
+                state->dataMem[loop->undo[numUndo][0]] = loop->undo[numUndo][1];
+                newState->dataMem[loop->undo[numUndo][0]] = loop->undo[numUndo][1];
+            }
+            return count;
+        }
+        count++;
+    }
+}
+
+// Called after each cycle that squashed in MEM
+void loopSquash(loopType *loop, stateType *state, stateType *newState) {
+    int branch = state->latchPc[TAG_MEMWB], before = state->latchPc[TAG_WBEND];
+    unsigned int slot = ((unsigned int)branch * 2654435761u ^ (unsigned int)before) >> (32 - LOOP_TABLEBITS);
+    loopEntryType *e = &loop->table[slot];
+    if (e->branch != branch || e->before != before){
+        e->branch = branch;
+        e->before = before;
+        e->haveIter = 0;
+    }
+    else{
+        unsigned int cycles = state->cycles - e->cycle;
+        unsigned long long retired = loop->retired - e->retired;
+        unsigned long long hash = loop->hash - e->hash * loopPower(retired);
+        if (e->haveIter && cycles == e->iterCycles && retired == e->iterRetired && hash == e->iterHash){
+            unsigned long long count = loopSkip(loop, e, state, newState);
+            statsType *s = &state->stats;
+            s->loadStalls += count * (s->loadStalls - e->stats.loadStalls);
+            s->memStalls += count * (s->memStalls - e->stats.memStalls);
+            s->branches += count * (s->branches - e->stats.branches);
+            s->mispredicts += count * (s->mispredicts - e->stats.mispredicts);
+            state->cycles += count * cycles;
+            loop->skippedCycles += count * cycles;
+            loop->iterations += count;
+            // the retired pcs repeat, so the hash can be moved on without them
+            unsigned long long power = loopPower(retired);
+            for (unsigned long long i = 0; i < count; i++){
+                loop->hash = loop->hash * power + hash;
+            }
+            loop->retired += count * retired;
+            e->haveIter = count > 0;
+        }
+        else{
+            e->iterCycles = cycles;
+            e->iterRetired = retired;
+            e->iterHash = hash;
+            e->haveIter = 1;
+        }
+    }
+    e->cycle = state->cycles;
+    e->retired = loop->retired;
+    e->hash = loop->hash;
+    e->stats = state->stats;
+}
+
+// simulate() for -q -l: no trace or checker, loops fast-forwarded
+void simulateLoops(const configType *config, stateType *state, stateType *newState) {
+    static loopType loop;
+    memset(loop.table, -1, sizeof(loop.table));
+    while (opcode(state->MEMWB.instr) != HALT) {
+        runCycle(config, state, newState);
+        if (newState->latchPc[TAG_WBEND] >= 0){
+            loop.retired++;
+            loop.hash = loop.hash * LOOP_PRIME + newState->latchPc[TAG_WBEND] + 1;
+        }
+        int squashed = !config->resolveInEx && newState->stats.mispredicts != state->stats.mispredicts;
+        commitCycle(state, newState);
+        if (squashed){
+            loopSquash(&loop, state, newState);
+        }
+    }
+    fprintf(stderr, "loops: %.1f%% of %u cycles skipped, %llu iterations\n",
+        state->cycles ? 100.0 * loop.skippedCycles / state->cycles : 0.0, state->cycles, loop.iterations);
+    if (loop.skippedCycles == 0){
+        fprintf(stderr, "loops: %s\n", config->resolveInEx ? "with resolve=ex no branch squashes in MEM, so none are skipped"
+            : config->predict != PREDICT_NOTTAKEN ? "no loop had a branch mispredicted every iteration; "
+                "with predict=bt or t, back edges are predicted right"
+            : "no loop repeated the same path in the same cycles");
+    }
+}
+
+/* ---------------------- Benchmarks ------------------- */
+// Times each kernel in every mode, writes one CSV row per kernel and mode,
+// and fails if a rate dropped more than tolerance percent below baseline.
+// Rates are only comparable on the machine that measured them, so a
+// missing baseline file is not an error: nothing gets compared.
+
+#define BENCH_KEYS "out,baseline,tolerance,mintime"
+
+typedef struct benchStruct {
+    stateType loaded; // the kernel as read from its file
+    stateType state, newState;
+    cosimType cosim;
+    unsigned long long instrs; // instructions the kernel executes
+    int sink; // descriptor of the file stdout goes to while timing
+    int console; // the real stdout, for errors
+    double minTime; // how long to keep repeating each measurement
+} benchType;
+
+void benchReset(benchType *bench) {
+    bench->state = bench->loaded;
+    bench->newState = bench->loaded;
+}
+
+// Bytes written to stdout since the last call
+long benchDrain(benchType *bench) {
+    fflush(stdout);
+    long bytes = lseek(bench->sink, 0, SEEK_CUR);
+    if (ftruncate(bench->sink, 0) != 0 || lseek(bench->sink, 0, SEEK_SET) != 0){
+        bytes = 0;
+    }
+    return bytes;
+}
+
+// Time one mode: load, func, quiet, check or trace. Fills in the counts and
+// returns the seconds taken.
+double benchMode(benchType *bench, const char *file, const char *mode,
+        unsigned long long *cycles, unsigned long long *instrs, long *bytes) {
+    double start = wallTime();
+    double secs;
+    *cycles = *instrs = 0;
+    *bytes = 0;
+    do {
+        if (strcmp(mode, "load") == 0){
+            // readMachineCode never closes its file, so loads go through
+            // readImage, which does
+            *instrs += readImage(file, bench->state.instrMem); // words loaded
+        }
+        else if (strcmp(mode, "func") == 0){
+            benchReset(bench);
+            *instrs += funcRun(&bench->state);
+        }
+        else{
+            int trace = strcmp(mode, "trace") == 0;
+            cosimType *cosim = strcmp(mode, "check") == 0 ? &bench->cosim : NULL;
+            int done = 0;
+            benchReset(bench);
+            if (cosim){
+                cosimInit(cosim, &bench->state);
+            }
+            // a full trace of a long kernel takes far too long, so it
+            // stops once minTime is up rather than at halt
+            while (!done && !(trace && wallTime() - start > bench->minTime)) {
+                done = simulate(&defaultConfig, &bench->state, &bench->newState, trace, cosim, trace ? 1 : 4096);
+                if (done < 0){
+                    fflush(stdout);
+                    dup2(bench->console, fileno(stdout));
+                    cosimReport(cosim);
+                    exit(1);
+                }
+            }
+            *cycles += bench->state.cycles;
+            if (done){
+                *instrs += bench->instrs;
+            }
+        }
+        *bytes += benchDrain(bench);
+    } while ((secs = wallTime() - start) < bench->minTime);
+    return secs;
+}
+
+int benchMain(const char *spec, int numFiles, char **files) {
+    static benchType bench;
+    static const char *modes[] = { "load", "func", "quiet", "check", "trace" };
+    const char *outName = specFind(spec, "out");
+    const char *baseName = specFind(spec, "baseline");
+    double tolerance = specValue(spec, "tolerance", 20);
+    char name[256];
+    int regressions = 0;
+    FILE *out = NULL;
+    FILE *base = NULL;
+
+    specCheck(spec, BENCH_KEYS);
+    bench.minTime = specValue(spec, "mintime", 200) / 1000.0;
+    if (outName){
+        snprintf(name, sizeof(name), "%.*s", (int)strcspn(outName, ","), outName);
+        out = fopen(name, "w");
+        if (!out){
+            printf("error: can't open file %s\n", name);
+            exit(1);
+        }
+        fprintf(out, "kernel,mode,cycles,instrs,bytes,seconds,rate\n");
+    }
+    if (baseName){
+        snprintf(name, sizeof(name), "%.*s", (int)strcspn(baseName, ","), baseName);
+        base = fopen(name, "r");
+        if (!base){
+            printf("bench: no baseline in %s, nothing compared\n", name);
+        }
+    }
+
+    FILE *sink = tmpfile();
+    int console = dup(fileno(stdout));
+    if (!sink || console < 0){
+        printf("error: can't redirect output\n");
+        exit(1);
+    }
+    bench.sink = fileno(sink);
+    bench.console = console;
+
+    // for load, instrs counts the words read
+    printf("%-12s %-6s %12s %12s %10s %10s\n", "kernel", "mode", "Mcycles/s", "Minstrs/s", "MB/s", "baseline");
+    for (int f = 0; f < numFiles; f++){
+        const char *kernel = strrchr(files[f], '/') ? strrchr(files[f], '/') + 1 : files[f];
+        // keep a loaded copy to reset from. This also checks that the file
+        // reads and runs, with stdout still on the console for the errors.
+        memset(&bench.loaded, 0, sizeof(bench.loaded));
+        bench.loaded.numMemory = readImage(files[f], bench.loaded.instrMem);
+        memcpy(bench.loaded.dataMem, bench.loaded.instrMem, bench.loaded.numMemory * sizeof(int));
+        resetState(&bench.loaded);
+        benchReset(&bench);
+        bench.instrs = funcRun(&bench.state);
+        fflush(stdout);
+        dup2(bench.sink, fileno(stdout));
+
+        for (int m = 0; m < 5; m++){
+            unsigned long long cycles, instrs;
+            long bytes;
+            double secs = benchMode(&bench, files[f], modes[m], &cycles, &instrs, &bytes);
+            // the rate that gets compared: words/s for load, instructions/s for
+            // func and cycles/s for the pipeline modes
+            double rate = (m < 2 ? instrs : cycles) / secs;
+            double baseRate = 0;
+            char line[512], k[256], md[32];
+
+            fflush(stdout);
+            dup2(console, fileno(stdout));
+            if (out){
+                fprintf(out, "%s,%s,%llu,%llu,%ld,%.6f,%.1f\n", kernel, modes[m], cycles, instrs, bytes, secs, rate);
+            }
+            if (base){
+                double r;
+                rewind(base);
+                while (fgets(line, sizeof(line), base)) {
+                    if (sscanf(line, "%255[^,],%31[^,],%*[^,],%*[^,],%*[^,],%*[^,],%lf", k, md, &r) == 3
+                            && strcmp(k, kernel) == 0 && strcmp(md, modes[m]) == 0){
+                        baseRate = r;
+                    }
+                }
+            }
+            printf("%-12s %-6s %12.2f %12.2f %10.2f", kernel, modes[m], cycles / secs / 1e6, instrs / secs / 1e6, bytes / secs / 1e6);
+            if (baseRate > 0){
+                double change = 100 * (rate - baseRate) / baseRate;
+                printf(" %+9.1f%%", change);
+                if (change < -tolerance){
+                    printf("  REGRESSION");
+                    regressions++;
+                }
+            }
+            printf("\n");
+            fflush(stdout);
+            dup2(bench.sink, fileno(stdout));
+        }
+        fflush(stdout);
+        dup2(console, fileno(stdout));
+    }
+    if (out){
+        fclose(out);
+    }
+    if (base){
+        fclose(base);
+    }
+    if (regressions){
+        printf("bench: %d rates more than %.0f%% below baseline\n", regressions, tolerance);
+    }
+    return regressions != 0;
+}
+
+/* ------------- Trace capture and replay ------------- */
+// -trace runs the program once on the reference model and writes every
+// retired instruction to a binary trace. The trace starts with "LC2KTRC1",
+// the word count and the program image, and then has chunks, each with its
+// byte and record counts. An empty chunk ends it. A record is one byte with
+// the opcode, the branch outcome and flags. If the pc isn't the last one
+// plus one, the flag is followed by a zigzag varint of the difference. For
+// lw and sw, a varint of the change in effective address follows. The rest
+// of the instruction is in the image.
+//
+// The replay engine is the pipeline's timing without any of its values. It
+// takes branch outcomes from the trace and fetches down the wrong path from
+// the image, as the pipeline does. It never looks at dataMem. A sweep over
+// a trace file replays it, one config per thread.
+
+#define TRACE_MAGIC "LC2KTRC1"
+#define TRACE_CHUNK 65536 // bytes of records per chunk
+#define TRACE_TAKEN 0x08
+#define TRACE_JUMP 0x10 // a pc difference follows
+#define TRACE_ADDR 0x20 // an address difference follows
+#define TRACE_RING 16 // records kept decoded, more than can be in flight
+
+typedef struct traceStruct {
+    int numWords;
+    int *image;
+    unsigned char *data; // the chunks
+    long size;
+    unsigned long long records;
+} traceType;
+
+typedef struct traceRecordStruct {
+    int pc;
+    int op;
+    int taken;
+    int addr;
+} traceRecordType;
+
+static inline unsigned char *putVarint(unsigned char *p, int value) {
+    unsigned int zigzag = ((unsigned int)value << 1) ^ (unsigned int)(value >> 31);
+    while (zigzag >= 0x80) {
+        *p++ = zigzag | 0x80;
+        zigzag >>= 7;
+    }
+    *p++ = zigzag;
+    return p;
+}
+
+static inline const unsigned char *getVarint(const unsigned char *p, int *value) {
+    unsigned int zigzag = 0;
+    for (int shift = 0; ; shift += 7) {
+        zigzag |= (unsigned int)(*p & 0x7F) << shift;
+        if (!(*p++ & 0x80)){
+            break;
+        }
+    }
+    *value = (int)(zigzag >> 1) ^ -(int)(zigzag & 1);
+    return p;
+}
+
+// getVarint for bytes that haven't been checked: NULL if the varint runs
+// past end or is longer than an int needs
+const unsigned char *getVarintIn(const unsigned char *p, const unsigned char *end, int *value) {
+    for (int i = 0; i < 5 && p + i < end; i++){
+        if (!(p[i] & 0x80)){
+            return getVarint(p, value);
+        }
+    }
+    return NULL;
+}
+
+// Records in the chunk payload from p to end, -1 if one runs past it.
+// *halts counts the halts and *lastOp is the last opcode.
+long traceRecords(const unsigned char *p, const unsigned char *end, int *halts, int *lastOp) {
+    long records = 0;
+    int value;
+    while (p && p < end) {
+        int flags = *p++;
+        *lastOp = flags & 0x7;
+        *halts += *lastOp == HALT;
+        if (flags & TRACE_JUMP){
+            p = getVarintIn(p, end, &value);
+        }
+        if (p && (flags & TRACE_ADDR)){
+            p = getVarintIn(p, end, &value);
+        }
+        records++;
+    }
+    return p ? records : -1;
+}
+
+void traceChunk(FILE *out, const unsigned char *chunk, unsigned int bytes, unsigned int records) {
+    unsigned int header[2] = { bytes, records };
+    fwrite(header, sizeof(header), 1, out);
+    fwrite(chunk, 1, bytes, out);
+}
+
+// Run state's program on the reference model, writing its trace to
+// filename. Returns the number of records, and the bytes of chunks in *bytes.
+unsigned long long traceCapture(stateType *state, const char *filename, long *bytes) {
+    static unsigned char chunk[TRACE_CHUNK + 16];
+    unsigned char *p = chunk;
+    unsigned int records = 0;
+    unsigned long long total = 0;
+    int lastPc = -1, lastAddr = 0, op;
+    retireType r;
+    FILE *out = fopen(filename, "wb");
+    if (!out){
+        printf("error: can't open file %s\n", filename);
+        exit(1);
+    }
+    fwrite(TRACE_MAGIC, 8, 1, out);
+    fwrite(&state->numMemory, sizeof(int), 1, out);
+    fwrite(state->instrMem, sizeof(int), state->numMemory, out);
+    *bytes = 2 * sizeof(int); // the empty chunk at the end
+
+    do {
+        op = funcStep(&state->pc, state->reg, state->dataMem, state->instrMem, &r);
+        if (op < 0){
+            printf("error: address out of range at pc %d\n", r.pc);
+            exit(1);
+        }
+        unsigned char *flags = p++;
+        *flags = op | (op == BEQ && r.taken ? TRACE_TAKEN : 0);
+        if (r.pc != lastPc + 1){
+            *flags |= TRACE_JUMP;
+            p = putVarint(p, r.pc - (lastPc + 1));
+        }
+        if (op == LW || op == SW){
+            *flags |= TRACE_ADDR;
+            p = putVarint(p, r.memAddr - lastAddr);
+            lastAddr = r.memAddr;
+        }
+        lastPc = r.pc;
+        records++;
+        if (p - chunk >= TRACE_CHUNK || op == HALT){
+            traceChunk(out, chunk, p - chunk, records);
+            *bytes += 2 * sizeof(int) + (p - chunk);
+            total += records;
+            p = chunk;
+            records = 0;
+        }
+    } while (op != HALT);
+    traceChunk(out, chunk, 0, 0);
+    fclose(out);
+    return total;
+}
+
+// Load a trace file. Returns 0 if filename isn't a trace.
+int traceLoad(const char *filename, traceType *trace) {
+    char magic[8];
+    FILE *in = fopen(filename, "rb");
+    if (!in || fread(magic, 8, 1, in) != 1 || memcmp(magic, TRACE_MAGIC, 8) != 0){
+        if (in){
+            fclose(in);
+        }
+        return 0;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in) - 8;
+    fseek(in, 8, SEEK_SET);
+    unsigned char *buffer = malloc(size);
+    if (!buffer || fread(buffer, 1, size, in) != (size_t)size){
+        printf("error: can't read trace %s\n", filename);
+        exit(1);
+    }
+    fclose(in);
+
+    if (size < (long)sizeof(int)){
+        printf("error: trace %s is cut short\n", filename);
+        exit(1);
+    }
+    memcpy(&trace->numWords, buffer, sizeof(int));
+    if (trace->numWords < 0 || trace->numWords > NUMMEMORY
+            || (long)sizeof(int) * (1 + trace->numWords) > size){
+        printf("error: trace %s is corrupt\n", filename);
+        exit(1);
+    }
+    trace->image = (int *)(buffer + sizeof(int));
+    trace->data = buffer + sizeof(int) * (1 + trace->numWords);
+    trace->size = size - sizeof(int) * (1 + trace->numWords);
+    trace->records = 0;
+
+    // decode every chunk once, so replay can trust the counts and varints
+    // and the trace ends on its only halt
+    int halts = 0, lastOp = -1;
+    for (long at = 0; ; ) {
+        unsigned int header[2];
+        if (at + (long)sizeof(header) > trace->size){
+            printf("error: trace %s is cut short\n", filename);
+            exit(1);
+        }
+        memcpy(header, trace->data + at, sizeof(header));
+        at += sizeof(header);
+        if (header[1] == 0 && header[0] == 0){
+            break;
+        }
+        if (header[0] > trace->size - at){
+            printf("error: trace %s is cut short\n", filename);
+            exit(1);
+        }
+        const unsigned char *payload = trace->data + at;
+        if (traceRecords(payload, payload + header[0], &halts, &lastOp) != header[1]){
+            printf("error: trace %s is corrupt\n", filename);
+            exit(1);
+        }
+        trace->records += header[1];
+        at += header[0];
+    }
+    if (halts != 1 || lastOp != HALT){
+        printf("error: trace %s is corrupt\n", filename);
+        exit(1);
+    }
+    return 1;
+}
+
+// One latch of the replay pipeline
+typedef struct replayLatchStruct {
+    int instr;
+    int pc;
+    long long seq; // which record it is, -1 for a bubble or the wrong path
+} replayLatchType;
+
+typedef struct replayStruct {
+    const traceType *trace;
+    const configType *config;
+    const unsigned char *at; // next record to decode
+    unsigned int left; // records left in its chunk
+    int lastPc, lastAddr;
+    long long decoded; // records decoded so far
+    traceRecordType ring[TRACE_RING];
+
+    int pc;
+    replayLatchType IFID, IDEX, EXMEM, MEMWB;
+    int memWait;
+    int onPath; // fetch is on the path the trace took
+    long long nextSeq; // record fetch expects next
+    unsigned long long cycles;
+    statsType stats;
+} replayType;
+
+const replayLatchType replayBubble = { NOOPINSTR, -1, -1 };
+
+// Record seq, NULL past the end of the trace
+const traceRecordType *replayRecord(replayType *r, long long seq) {
+    while (r->decoded <= seq) {
+        if (r->left == 0){
+            unsigned int header[2];
+            memcpy(header, r->at, sizeof(header));
+            if (header[1] == 0){
+                return NULL;
+            }
+            r->left = header[1];
+            r->at += sizeof(header);
+        }
+        traceRecordType *record = &r->ring[r->decoded % TRACE_RING];
+        int flags = *r->at++, delta = 0;
+        record->op = flags & 0x7;
+        record->taken = (flags & TRACE_TAKEN) != 0;
+        if (flags & TRACE_JUMP){
+            r->at = getVarint(r->at, &delta);
+        }
+        record->pc = r->lastPc = r->lastPc + 1 + delta;
+        if (flags & TRACE_ADDR){
+            r->at = getVarint(r->at, &delta);
+            r->lastAddr += delta;
+        }
+        record->addr = r->lastAddr;
+        r->left--;
+        r->decoded++;
+    }
+    return &r->ring[seq % TRACE_RING];
+}
+
+// Where a resolved branch really goes, and whether fetch guessed wrong
+int replayResolve(replayType *r, const replayLatchType *branch, int *target) {
+    const traceRecordType *record = branch->seq >= 0 ? replayRecord(r, branch->seq) : NULL;
+    if (!record || record->op != BEQ){
+        printf("error: trace doesn't match its program at pc %d\n", branch->pc);
+        exit(1);
+    }
+    r->stats.branches++;
+    *target = branch->pc + 1 + (record->taken ? convertNum(field2(branch->instr)) : 0);
+    return record->taken != predictTaken(r->config, branch->instr);
+}
+
+// runCycle without values
+void replayCycle(replayType *r) {
+    const configType *config = r->config;
+    int target;
+    r->cycles++;
+    if (r->memWait > 0){
+        r->memWait--;
+        r->stats.memStalls++;
+        r->MEMWB = replayBubble;
+        return;
+    }
+
+    // IF
+    // memory past the image is zero, as in instrMem
+    replayLatchType fetched = { 0, r->pc, -1 };
+    if (r->pc >= 0 && r->pc < r->trace->numWords){
+        fetched.instr = r->trace->image[r->pc];
+    }
+    const traceRecordType *expected = r->onPath ? replayRecord(r, r->nextSeq) : NULL;
+    int onPath = expected && expected->pc == r->pc;
+    int pc = r->pc + 1;
+    if (onPath){
+        fetched.seq = r->nextSeq;
+    }
+    if (opcode(fetched.instr) == BEQ && predictTaken(config, fetched.instr)){
+        int predicted = r->pc + 1 + convertNum(field2(fetched.instr));
+        pc = predicted >= 0 && predicted < NUMMEMORY ? predicted : pc;
+    }
+    if (onPath && expected->op == BEQ){
+        onPath = pc == r->pc + 1 + (expected->taken ? convertNum(field2(fetched.instr)) : 0);
+    }
+
+    // ID
+    replayLatchType IFID = fetched, IDEX = r->IFID;
+    if (opcode(r->IDEX.instr) == LW && !config->earlyLoad
+            && (field1(r->IFID.instr) == field1(r->IDEX.instr) || field0(r->IFID.instr) == field1(r->IDEX.instr))){
+        IFID = r->IFID;
+        IDEX = replayBubble;
+        pc = r->pc;
+        r->stats.loadStalls++;
+    }
+    else{
+        r->nextSeq += fetched.seq >= 0;
+        r->onPath = onPath;
+    }
+
+    // EX
+    replayLatchType EXMEM = r->IDEX;
+    if (config->resolveInEx && opcode(EXMEM.instr) == BEQ && replayResolve(r, &EXMEM, &target)){
+        r->stats.mispredicts++;
+        IFID = IDEX = replayBubble;
+        pc = target;
+        r->onPath = 1;
+        r->nextSeq = EXMEM.seq + 1;
+    }
+    if (opcode(EXMEM.instr) == LW || opcode(EXMEM.instr) == SW){
+        r->memWait = config->memLatency;
+    }
+
+    // MEM
+    if (!config->resolveInEx && opcode(r->EXMEM.instr) == BEQ && replayResolve(r, &r->EXMEM, &target)){
+        r->stats.mispredicts++;
+        IFID = IDEX = EXMEM = replayBubble;
+        pc = target;
+        r->memWait = 0;
+        r->onPath = 1;
+        r->nextSeq = r->EXMEM.seq + 1;
+    }
+
+    r->MEMWB = r->EXMEM;
+    r->EXMEM = EXMEM;
+    r->IDEX = IDEX;
+    r->IFID = IFID;
+    r->pc = pc;
+}
+
+// Replay trace under config, returns the cycles it takes
+unsigned long long replayRun(const configType *config, const traceType *trace, statsType *stats) {
+    replayType *r = calloc(1, sizeof(replayType));
+    if (!r){
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    r->trace = trace;
+    r->config = config;
+    r->at = trace->data;
+    r->lastPc = -1;
+    r->IFID = r->IDEX = r->EXMEM = r->MEMWB = replayBubble;
+    r->onPath = 1;
+    while (opcode(r->MEMWB.instr) != HALT) {
+        replayCycle(r);
+    }
+    unsigned long long cycles = r->cycles;
+    *stats = r->stats;
+    free(r);
+    return cycles;
+}
+
+// -trace: capture filename's trace into traceName
+int traceMain(const char *traceName, const char *filename) {
+    static stateType state;
+    state.numMemory = readImage(filename, state.instrMem);
+    memcpy(state.dataMem, state.instrMem, state.numMemory * sizeof(int));
+    resetState(&state);
+    double start = wallTime();
+    long size;
+    unsigned long long records = traceCapture(&state, traceName, &size);
+    double secs = wallTime() - start;
+    fprintf(stderr, "trace: %llu instructions in %ld bytes, %.2f bytes each, %.2f s\n",
+        records, size, (double)size / records, secs);
+    return 0;
+}
+
+/* ------------------- Design sweeps ------------------- */
+// Runs one program under every config in a grid such as
+// "mem=0/2/4,predict=nt/bt" on host threads and prints a row per config.
+// The image is read once and shared read-only; each worker copies it into
+// its own pair of states, which costs next to nothing next to a run.
+// Given a trace file instead, every config replays the same trace.
+
+#define SWEEP_KEYS CONFIG_KEYS ",jobs,out,format"
+
+typedef struct sweepRowStruct {
+    configType config;
+    unsigned long long cycles;
+    statsType stats;
+    double seconds;
+} sweepRowType;
+
+typedef struct sweepStruct {
+    const int *image;
+    int numWords;
+    unsigned long long instrs; // from one functional run, the same for every config
+    const traceType *trace; // replayed instead of simulated, if not NULL
+    sweepRowType *rows;
+    int numRows;
+    int next;
+    pthread_mutex_t lock;
+} sweepType;
+
+void *sweepThread(void *arg) {
+    sweepType *sweep = arg;
+    stateType *state = malloc(sizeof(stateType));
+    stateType *newState = malloc(sizeof(stateType));
+    if (!state || !newState){
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    for (;;) {
+        pthread_mutex_lock(&sweep->lock);
+        int i = sweep->next++;
+        pthread_mutex_unlock(&sweep->lock);
+        if (i >= sweep->numRows){
+            break;
+        }
+
+        sweepRowType *row = &sweep->rows[i];
+        double start = wallTime();
+        if (sweep->trace){
+            row->cycles = replayRun(&row->config, sweep->trace, &row->stats);
+            row->seconds = wallTime() - start;
+            continue;
+        }
+        memset(state->instrMem, 0, sizeof(state->instrMem));
+        memset(state->dataMem, 0, sizeof(state->dataMem));
+        memcpy(state->instrMem, sweep->image, sweep->numWords * sizeof(int));
+        memcpy(state->dataMem, sweep->image, sweep->numWords * sizeof(int));
+        state->numMemory = sweep->numWords;
+        resetState(state);
+        *newState = *state;
+        simulate(&row->config, state, newState, 0, NULL, -1);
+        row->cycles = state->cycles;
+        row->stats = state->stats;
+        row->seconds = wallTime() - start;
+    }
+    free(state);
+    free(newState);
+    return NULL;
+}
+
+int sweepMain(const char *spec, const char *filename) {
+    static int image[NUMMEMORY];
+    static stateType state;
+    static const char *keys[] = { "mem", "early", "predict", "resolve" };
+    static sweepType sweep;
+    static traceType trace;
+    long jobs = specValue(spec, "jobs", sysconf(_SC_NPROCESSORS_ONLN));
+    const char *format = specFind(spec, "format");
+    size_t formatLen = format ? strcspn(format, ",") : 0;
+    int json = formatLen == 4 && strncmp(format, "json", 4) == 0;
+    const char *outName = specFind(spec, "out");
+    FILE *out = stdout;
+    pthread_t threads[256];
+    int counts[4];
+
+    specCheck(spec, SWEEP_KEYS);
+    if (format && !json && !(formatLen == 3 && strncmp(format, "csv", 3) == 0)){
+        printf("error: bad value for format, expected csv or json\n");
+        exit(1);
+    }
+    if (traceLoad(filename, &trace)){
+        sweep.trace = &trace;
+        sweep.image = trace.image;
+        sweep.numWords = trace.numWords;
+        sweep.instrs = trace.records;
+    }
+    else{
+        sweep.image = image;
+        sweep.numWords = readImage(filename, image);
+
+        // the instruction count for CPI
+        memcpy(state.instrMem, image, sweep.numWords * sizeof(int));
+        memcpy(state.dataMem, image, sweep.numWords * sizeof(int));
+        resetState(&state);
+        sweep.instrs = funcRun(&state);
+    }
+
+    // expand the grid, the first key varying slowest
+    sweep.numRows = 1;
+    for (int k = 0; k < 4; k++){
+        const char *value = specFind(spec, keys[k]);
+        counts[k] = 1;
+        while (value && *value && *value != ',') {
+            value += strcspn(value, ",/");
+            if (*value == '/'){
+                counts[k]++;
+                value++;
+            }
+        }
+        sweep.numRows *= counts[k];
+    }
+    sweep.rows = calloc(sweep.numRows, sizeof(sweepRowType));
+    if (!sweep.rows){
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < sweep.numRows; i++){
+        int rest = i;
+        sweep.rows[i].config = defaultConfig;
+        for (int k = 3; k >= 0; k--){
+            const char *value = specFind(spec, keys[k]);
+            int pick = rest % counts[k];
+            rest /= counts[k];
+            for (int j = 0; value && j < pick; j++){
+                value += strcspn(value, ",/") + 1;
+            }
+            if (value && configSet(&sweep.rows[i].config, keys[k], value)){
+                printf("error: bad value for %s in %s\n", keys[k], spec);
+                exit(1);
+            }
+        }
+    }
+
+    if (jobs < 1){
+        jobs = 1;
+    }
+    if (jobs > 256){
+        jobs = 256;
+    }
+    if (jobs > sweep.numRows){
+        jobs = sweep.numRows;
+    }
+    pthread_mutex_init(&sweep.lock, NULL);
+    double start = wallTime();
+    for (long i = 0; i < jobs; i++){
+        pthread_create(&threads[i], NULL, sweepThread, &sweep);
+    }
+    for (long i = 0; i < jobs; i++){
+        pthread_join(threads[i], NULL);
+    }
+    double secs = wallTime() - start;
+
+    if (outName){
+        char name[256];
+        snprintf(name, sizeof(name), "%.*s", (int)strcspn(outName, ","), outName);
+        out = fopen(name, "w");
+        if (!out){
+            printf("error: can't open file %s\n", name);
+            exit(1);
+        }
+    }
+    if (json){
+        fprintf(out, "[\n");
+    }
+    else{
+        fprintf(out, "mem,early,predict,resolve,cycles,instrs,cpi,loadStalls,memStalls,branches,mispredicts,seconds\n");
+    }
+    for (int i = 0; i < sweep.numRows; i++){
+        const sweepRowType *row = &sweep.rows[i];
+        const configType *c = &row->config;
+        const statsType *s = &row->stats;
+        double cpi = (double)row->cycles / sweep.instrs;
+        if (json){
+            fprintf(out, "  {\"mem\": %d, \"early\": %d, \"predict\": \"%s\", \"resolve\": \"%s\", "
+                "\"cycles\": %llu, \"instrs\": %llu, \"cpi\": %.4f, \"loadStalls\": %llu, \"memStalls\": %llu, "
+                "\"branches\": %llu, \"mispredicts\": %llu, \"seconds\": %.6f}%s\n",
+                c->memLatency, c->earlyLoad, predictNames[c->predict], resolveNames[c->resolveInEx],
+                row->cycles, sweep.instrs, cpi, s->loadStalls, s->memStalls, s->branches, s->mispredicts,
+                row->seconds, i + 1 < sweep.numRows ? "," : "");
+        }
+        else{
+            fprintf(out, "%d,%d,%s,%s,%llu,%llu,%.4f,%llu,%llu,%llu,%llu,%.6f\n",
+                c->memLatency, c->earlyLoad, predictNames[c->predict], resolveNames[c->resolveInEx],
+                row->cycles, sweep.instrs, cpi, s->loadStalls, s->memStalls, s->branches, s->mispredicts,
+                row->seconds);
+        }
+    }
+    if (json){
+        fprintf(out, "]\n");
+    }
+    if (out != stdout){
+        fclose(out);
+    }
+    // stdout may be the table itself
+    fprintf(stderr, "sweep: %d configs on %ld threads in %.2f s%s\n", sweep.numRows, jobs, secs,
+        sweep.trace ? ", replayed" : "");
+    free(sweep.rows);
+    return 0;
+}
+
+/* ---------------- Sampled simulation ----------------- */
+// SMARTS-style sampling: every period instructions, run warmup instructions
+// through the pipeline to fill it, then measure the cycles of the next window
+// instructions. Everything else runs on the reference model. Total cycles are
+// estimated from the mean CPI of the windows, with a 95% confidence interval.
+// Static prediction means the latches are the only state that needs warming.
+
+#define SAMPLE_KEYS CONFIG_KEYS ",period,window,warmup,full"
+
+// Empty the pipeline so that it starts fetching at state->pc
+void flushPipeline(stateType *state) {
+    state->IFID.instr = NOOPINSTR;
+    state->IDEX.instr = NOOPINSTR;
+    state->EXMEM.instr = NOOPINSTR;
+    state->MEMWB.instr = NOOPINSTR;
+    state->WBEND.instr = NOOPINSTR;
+    for (int i = 0; i < NUMSTAGES; i++){
+        state->latchPc[i] = -1;
+    }
+    state->memWait = 0;
+}
+
+// Run up to count instructions on the reference model, stopping before a
+// halt. Stores go to both states so that their memories stay the same.
+// Returns the number run.
+unsigned long long fastForward(stateType *state, stateType *newState, unsigned long long count) {
+    unsigned long long done = 0;
+    retireType r;
+    while (done < count && opcode(state->instrMem[state->pc]) != HALT) {
+        int op = funcStep(&state->pc, state->reg, state->dataMem, state->instrMem, &r);
+        if (op < 0){
+            printf("error: address out of range at pc %d\n", r.pc);
+            exit(1);
+        }
+        if (op == SW){
+            newState->dataMem[r.memAddr] = r.memVal;
+        }
+        done++;
+    }
+    return done;
+}
+
+// Run the pipeline until count more instructions retire or it halts.
+// Returns the number retired and adds the cycles taken to *cycles.
+unsigned long long runRetired(const configType *config, stateType *state, stateType *newState,
+        unsigned long long count, unsigned long long *cycles) {
+    unsigned long long retired = 0;
+    while (retired < count && opcode(state->MEMWB.instr) != HALT) {
+        runCycle(config, state, newState);
+        retired += newState->latchPc[TAG_WBEND] >= 0;
+        commitCycle(state, newState);
+        (*cycles)++;
+    }
+    return retired;
+}
+
+// Leave the pipeline for the reference model: everything older than the
+// oldest instruction still in a latch has retired, so that's where to carry
+// on. If it's a sw in MEM/WB it has already stored, but storing the same
+// word again does no harm.
+void leavePipeline(stateType *state) {
+    for (int i = TAG_MEMWB; i >= TAG_IFID; i--){
+        if (state->latchPc[i] >= 0){
+            state->pc = state->latchPc[i];
+            break;
+        }
+    }
+    flushPipeline(state);
+}
+
+int sampleMain(const char *spec, const char *filename) {
+    static int image[NUMMEMORY];
+    static stateType state, newState;
+    configType config;
+    unsigned long long period = specValue(spec, "period", 10000);
+    unsigned long long window = specValue(spec, "window", 1000);
+    unsigned long long warmup = specValue(spec, "warmup", 200);
+    unsigned long long instrs = 0, detailed = 0, cycles;
+    double sum = 0, sumSquares = 0;
+    long windows = 0;
+    int halted = 0;
+
+    specCheck(spec, SAMPLE_KEYS);
+    configParse(&config, spec);
+    if (window == 0 || period < window + warmup){
+        printf("error: need 0 < window and window + warmup <= period\n");
+        exit(1);
+    }
+    int numWords = readImage(filename, image);
+    memcpy(state.instrMem, image, numWords * sizeof(int));
+    memcpy(state.dataMem, image, numWords * sizeof(int));
+    state.numMemory = numWords;
+    resetState(&state);
+    newState = state;
+
+    double start = wallTime();
+    while (!halted) {
+        unsigned long long skip = period - window - warmup;
+        unsigned long long ran = fastForward(&state, &newState, skip);
+        instrs += ran;
+        if (ran < skip){
+            instrs++; // the halt
+            break;
+        }
+
+        flushPipeline(&state);
+        cycles = 0;
+        ran = runRetired(&config, &state, &newState, warmup, &cycles);
+        instrs += ran;
+        detailed += ran;
+        if (ran == warmup){
+            cycles = 0;
+            ran = runRetired(&config, &state, &newState, window, &cycles);
+            instrs += ran;
+            detailed += ran;
+            if (ran == window){
+                double cpi = (double)cycles / window;
+                sum += cpi;
+                sumSquares += cpi * cpi;
+                windows++;
+            }
+        }
+        halted = opcode(state.MEMWB.instr) == HALT;
+        if (halted){
+            instrs++; // the halt, which never gets to WB/END
+        }
+        else{
+            leavePipeline(&state);
+        }
+    }
+    double secs = wallTime() - start;
+
+    printf("sample: %llu instructions, %ld windows of %llu after %llu warm-up, every %llu\n",
+        instrs, windows, window, warmup, period);
+    if (windows == 0){
+        printf("sample: program too short for one window, lower period\n");
+        return 1;
+    }
+    double mean = sum / windows;
+    double error = 0;
+    if (windows > 1){
+        double variance = (sumSquares - sum * sum / windows) / (windows - 1);
+        error = 1.96 * sqrt(variance > 0 ? variance : 0) / sqrt(windows);
+    }
+    printf("sample: CPI %.4f +- %.4f (95%%), cycles %.0f +- %.0f\n", mean, error, mean * instrs, error * instrs);
+    printf("sample: %.1f%% of instructions detailed, %.3f s\n", 100.0 * detailed / instrs, secs);
+
+    if (specValue(spec, "full", 0)){
+        unsigned long long full = 0;
+        memcpy(state.instrMem, image, numWords * sizeof(int));
+        memset(state.dataMem, 0, sizeof(state.dataMem));
+        memcpy(state.dataMem, image, numWords * sizeof(int));
+        resetState(&state);
+        newState = state;
+        start = wallTime();
+        runRetired(&config, &state, &newState, -1, &full);
+        secs = wallTime() - start;
+        printf("full:   CPI %.4f, cycles %llu, estimate off by %+.2f%%, %.3f s\n",
+            (double)full / instrs, full, 100.0 * (mean * instrs - full) / full, secs);
+    }
+    return 0;
+}
+
+/* ------------------ Lane-parallel engine ------------------ */
+// Runs many independent machines at once with the project's pipeline (the
+// default config), struct-of-arrays style: lane l of every field belongs to
+// machine l, and its memories live at l * LANE_STRIDE. The AVX2 kernel steps
+// eight machines per vector, a portable kernel does the same one lane at a
+// time. A lane that halts is refilled with the next program straight away.
+// The portable kernel only runs about as fast as the scalar pipeline: it is
+// there for hosts without AVX2 and as a check on the AVX2 one, not for speed.
+
+#define LANES_KEYS GEN_KEYS ",n,lanes,simd"
+#define VLANES 8 // machines in one AVX2 vector of ints
+// Words between one lane's memory and the next. The extra cache line keeps
+// the same word of every lane out of the same cache set.
+#define LANE_STRIDE (NUMMEMORY + 16)
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define LANES_AVX2 1
+#include <immintrin.h>
+#endif
+
+typedef struct laneGroupStruct {
+    int pc[VLANES];
+    int reg[NUMREGS][VLANES];
+    int ifidInstr[VLANES], ifidPcPlus1[VLANES];
+    int idexInstr[VLANES], idexPcPlus1[VLANES], idexValA[VLANES], idexValB[VLANES], idexOffset[VLANES];
+    int exmemInstr[VLANES], exmemTarget[VLANES], exmemEq[VLANES], exmemAlu[VLANES], exmemValB[VLANES];
+    int memwbInstr[VLANES], memwbData[VLANES];
+    int wbendInstr[VLANES], wbendData[VLANES];
+    int cycles[VLANES];
+    int memTop[VLANES]; // dataMem is zero from here up
+    int program[VLANES]; // which program the lane is running, -1 once idle
+    int *instrMem, *dataMem;
+} laneGroupType;
+
+// what a scalar run of each program ended with, for checking the lanes
+typedef struct laneResultStruct {
+    unsigned int cycles;
+    int reg[NUMREGS];
+    unsigned int hash; // of dataMem up to memTop
+} laneResultType;
+
+typedef struct lanesStruct {
+    int count; // programs
+    int *images; // all programs back to back
+    int *start; // first word of each, count + 1 entries
+    laneResultType *results;
+} lanesType;
+
+// register an instruction writes, -1 if none
+static inline int destReg(int instr) {
+    int op = opcode(instr);
+    return op == LW ? field1(instr) : op == ADD || op == NOR ? field2(instr) : -1;
+}
+
+unsigned int hashWords(const int *words, int count) {
+    unsigned int hash = 2166136261u; // FNV-1a
+    for (int i = 0; i < count; i++){
+        hash = (hash ^ (unsigned int)words[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Start lane l on the next program, or leave it idle holding a halt if none are left
+void laneLoad(laneGroupType *g, int l, const lanesType *lanes, int *next) {
+    int *imem = g->instrMem + l * LANE_STRIDE;
+    int *dmem = g->dataMem + l * LANE_STRIDE;
+    int old = g->program[l];
+    if (old >= 0){
+        memset(imem, 0, (lanes->start[old + 1] - lanes->start[old]) * sizeof(int));
+        memset(dmem, 0, g->memTop[l] * sizeof(int));
+    }
+    g->program[l] = -1;
+    g->memwbInstr[l] = HALT << 22;
+    if (*next >= lanes->count){
+        return;
+    }
+    int p = g->program[l] = (*next)++;
+    int numWords = lanes->start[p + 1] - lanes->start[p];
+    memcpy(imem, lanes->images + lanes->start[p], numWords * sizeof(int));
+    memcpy(dmem, lanes->images + lanes->start[p], numWords * sizeof(int));
+    g->memTop[l] = numWords;
+    g->pc[l] = 0;
+    for (int i = 0; i < NUMREGS; i++){
+        g->reg[i][l] = 0;
+    }
+    g->ifidInstr[l] = g->idexInstr[l] = g->exmemInstr[l] = NOOPINSTR;
+    g->memwbInstr[l] = g->wbendInstr[l] = NOOPINSTR;
+    g->cycles[l] = 0;
+}
+
+// Check a halted lane against the scalar run of its program
+void laneCheck(const laneGroupType *g, int l, const lanesType *lanes) {
+    int p = g->program[l];
+    const laneResultType *want = &lanes->results[p];
+    int same = (unsigned int)g->cycles[l] == want->cycles
+        && hashWords(g->dataMem + l * LANE_STRIDE, g->memTop[l]) == want->hash;
+    for (int i = 0; i < NUMREGS; i++){
+        same &= g->reg[i][l] == want->reg[i];
+    }
+    if (!same){
+        printf("error: lane engine disagrees with the pipeline on program %d\n", p);
+        exit(1);
+    }
+}
+
+// One cycle of every lane that hasn't halted, one lane at a time.
+// Returns a bit for each lane that halted on this cycle.
+int laneCycle(laneGroupType *g) {
+    int halted = 0;
+    for (int l = 0; l < VLANES; l++) {
+        int memwb = g->memwbInstr[l];
+        if (opcode(memwb) == HALT){
+            continue;
+        }
+        // every field is read into a local first: the stores to dataMem and
+        // reg could alias any of them, which would force reloads
+        int ifid = g->ifidInstr[l], ifidPcPlus1 = g->ifidPcPlus1[l];
+        int idex = g->idexInstr[l], idexPcPlus1 = g->idexPcPlus1[l], offset = g->idexOffset[l];
+        int exmem = g->exmemInstr[l], exmemAlu = g->exmemAlu[l], exmemValB = g->exmemValB[l];
+        int memwbData = g->memwbData[l], wbend = g->wbendInstr[l], wbendData = g->wbendData[l];
+        int pc = g->pc[l], memTop = g->memTop[l];
+        int squash = opcode(exmem) == BEQ && g->exmemEq[l];
+        int target = g->exmemTarget[l];
+        int *dmem = g->dataMem + l * LANE_STRIDE;
+
+        // EX, forwarding from the newest latch that writes the register
+        int a = g->idexValA[l], b = g->idexValB[l];
+        int dest = destReg(wbend);
+        a = field0(idex) == dest ? wbendData : a;
+        b = field1(idex) == dest ? wbendData : b;
+        dest = destReg(memwb);
+        a = field0(idex) == dest ? memwbData : a;
+        b = field1(idex) == dest ? memwbData : b;
+        dest = destReg(exmem);
+        a = field0(idex) == dest ? exmemAlu : a;
+        b = field1(idex) == dest ? exmemAlu : b;
+        int op = opcode(idex), alu = 0;
+        if (op == ADD){
+            alu = a + b;
+        }
+        else if (op == NOR){
+            alu = ~(a | b);
+        }
+        else if (op == LW || op == SW){
+            alu = a + offset;
+        }
+        else if (op == BEQ){
+            alu = a - b;
+        }
+
+        // ID, reading the registers before WB writes them
+        int stall = op == LW && (field1(ifid) == field1(idex) || field0(ifid) == field1(idex));
+        int valA = g->reg[field0(ifid)][l], valB = g->reg[field1(ifid)][l];
+        int fetched = g->instrMem[l * LANE_STRIDE + (pc & (NUMMEMORY - 1))];
+
+        // MEM
+        int memOp = opcode(exmem), addr = exmemAlu & (NUMMEMORY - 1);
+        int data = memOp == LW ? dmem[addr] : exmemAlu;
+        if (memOp == SW){
+            dmem[addr] = exmemValB;
+            memTop = addr >= memTop ? addr + 1 : memTop;
+        }
+
+        // WB
+        dest = destReg(memwb);
+        if (dest >= 0 && dest < NUMREGS){
+            g->reg[dest][l] = memwbData;
+        }
+
+        g->wbendInstr[l] = memwb;
+        g->wbendData[l] = memwbData;
+        g->memwbInstr[l] = exmem;
+        g->memwbData[l] = data;
+        g->exmemInstr[l] = squash ? NOOPINSTR : idex;
+        g->exmemTarget[l] = idexPcPlus1 + offset;
+        g->exmemEq[l] = op == BEQ && a == b;
+        g->exmemAlu[l] = alu;
+        g->exmemValB[l] = b;
+        g->idexPcPlus1[l] = ifidPcPlus1;
+        g->memTop[l] = memTop;
+        if (stall){
+            g->idexInstr[l] = NOOPINSTR;
+        }
+        else{
+            g->idexInstr[l] = ifid;
+            g->idexValA[l] = valA;
+            g->idexValB[l] = valB;
+            g->idexOffset[l] = convertNum(field2(ifid));
+            g->ifidInstr[l] = fetched;
+            g->ifidPcPlus1[l] = pc + 1;
+            g->pc[l] = pc + 1;
+        }
+        if (squash){
+            g->ifidInstr[l] = g->idexInstr[l] = NOOPINSTR;
+            g->pc[l] = target;
+        }
+        g->cycles[l]++;
+        halted |= (opcode(exmem) == HALT) << l;
+    }
+    return halted;
+}
+
+#ifdef LANES_AVX2
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i vLoad(const int *p) {
+    return _mm256_loadu_si256((const __m256i *)p);
+}
+
+AVX2 static inline void vStore(int *p, __m256i v) {
+    _mm256_storeu_si256((__m256i *)p, v);
+}
+
+// v where mask is set, otherwise old
+AVX2 static inline __m256i vSelect(__m256i mask, __m256i v, __m256i old) {
+    return _mm256_blendv_epi8(old, v, mask);
+}
+
+AVX2 static inline __m256i vIs(__m256i v, int n) {
+    return _mm256_cmpeq_epi32(v, _mm256_set1_epi32(n));
+}
+
+AVX2 static inline __m256i vField(__m256i instr, int shift) {
+    return _mm256_and_si256(_mm256_srli_epi32(instr, shift), _mm256_set1_epi32(0x7));
+}
+
+AVX2 static inline __m256i vDestReg(__m256i instr) {
+    __m256i op = _mm256_srai_epi32(instr, 22);
+    __m256i lw = vIs(op, LW);
+    __m256i alu = _mm256_or_si256(vIs(op, ADD), vIs(op, NOR));
+    __m256i dest = vSelect(lw, vField(instr, 16), _mm256_and_si256(instr, _mm256_set1_epi32(0xFFFF)));
+    return vSelect(_mm256_or_si256(lw, alu), dest, _mm256_set1_epi32(-1));
+}
+
+// laneCycle for all eight lanes at once. Memory reads are gathers from the
+// lane's slice; AVX2 has no scatter, so stores go one lane at a time.
+AVX2 int laneCycleAvx2(laneGroupType *g) {
+    const __m256i slice = _mm256_setr_epi32(0, LANE_STRIDE, 2 * LANE_STRIDE, 3 * LANE_STRIDE,
+        4 * LANE_STRIDE, 5 * LANE_STRIDE, 6 * LANE_STRIDE, 7 * LANE_STRIDE);
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i addrMask = _mm256_set1_epi32(NUMMEMORY - 1);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i noop = _mm256_set1_epi32(NOOPINSTR);
+
+    __m256i ifid = vLoad(g->ifidInstr), idex = vLoad(g->idexInstr), exmem = vLoad(g->exmemInstr);
+    __m256i memwb = vLoad(g->memwbInstr), wbend = vLoad(g->wbendInstr);
+    __m256i memwbData = vLoad(g->memwbData), exmemAlu = vLoad(g->exmemAlu);
+    __m256i active = _mm256_xor_si256(vIs(_mm256_srai_epi32(memwb, 22), HALT), _mm256_set1_epi32(-1));
+    if (_mm256_testz_si256(active, active)){
+        return 0;
+    }
+
+    // EX
+    __m256i a = vLoad(g->idexValA), b = vLoad(g->idexValB), offset = vLoad(g->idexOffset);
+    __m256i src0 = vField(idex, 19), src1 = vField(idex, 16);
+    __m256i forwards[3][2] = {
+        { vDestReg(wbend), vLoad(g->wbendData) },
+        { vDestReg(memwb), memwbData },
+        { vDestReg(exmem), exmemAlu }
+    };
+    for (int i = 0; i < 3; i++){
+        a = vSelect(_mm256_cmpeq_epi32(src0, forwards[i][0]), forwards[i][1], a);
+        b = vSelect(_mm256_cmpeq_epi32(src1, forwards[i][0]), forwards[i][1], b);
+    }
+    __m256i op = _mm256_srai_epi32(idex, 22);
+    __m256i alu = _mm256_setzero_si256();
+    alu = vSelect(vIs(op, ADD), _mm256_add_epi32(a, b), alu);
+    alu = vSelect(vIs(op, NOR), _mm256_xor_si256(_mm256_or_si256(a, b), _mm256_set1_epi32(-1)), alu);
+    alu = vSelect(_mm256_or_si256(vIs(op, LW), vIs(op, SW)), _mm256_add_epi32(a, offset), alu);
+    alu = vSelect(vIs(op, BEQ), _mm256_sub_epi32(a, b), alu);
+    __m256i eq = _mm256_and_si256(_mm256_and_si256(vIs(op, BEQ), _mm256_cmpeq_epi32(a, b)), one);
+
+    // MEM
+    __m256i memOp = _mm256_srai_epi32(exmem, 22);
+    __m256i addr = _mm256_and_si256(exmemAlu, addrMask);
+    __m256i load = _mm256_and_si256(vIs(memOp, LW), active);
+    __m256i data = _mm256_mask_i32gather_epi32(exmemAlu, g->dataMem, _mm256_add_epi32(addr, slice), load, 4);
+    int stores = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(vIs(memOp, SW), active)));
+    for (int l = 0; stores; l++, stores >>= 1){
+        if (stores & 1){
+            int word = g->exmemAlu[l] & (NUMMEMORY - 1);
+            g->dataMem[l * LANE_STRIDE + word] = g->exmemValB[l];
+            g->memTop[l] = word >= g->memTop[l] ? word + 1 : g->memTop[l];
+        }
+    }
+    __m256i squash = _mm256_and_si256(vIs(memOp, BEQ), _mm256_cmpeq_epi32(vLoad(g->exmemEq), one));
+    __m256i target = vLoad(g->exmemTarget);
+
+    // ID, gathering each lane's registers before WB writes them
+    __m256i stall = _mm256_and_si256(vIs(op, LW),
+        _mm256_or_si256(_mm256_cmpeq_epi32(vField(ifid, 16), src1), _mm256_cmpeq_epi32(vField(ifid, 19), src1)));
+    __m256i regIndex0 = _mm256_add_epi32(_mm256_slli_epi32(vField(ifid, 19), 3), lane);
+    __m256i regIndex1 = _mm256_add_epi32(_mm256_slli_epi32(vField(ifid, 16), 3), lane);
+    __m256i valA = _mm256_i32gather_epi32(&g->reg[0][0], regIndex0, 4);
+    __m256i valB = _mm256_i32gather_epi32(&g->reg[0][0], regIndex1, 4);
+
+    // IF
+    __m256i pc = vLoad(g->pc);
+    __m256i fetched = _mm256_i32gather_epi32(g->instrMem, _mm256_add_epi32(_mm256_and_si256(pc, addrMask), slice), 4);
+
+    // WB
+    __m256i dest = vDestReg(memwb);
+    for (int r = 0; r < NUMREGS; r++){
+        __m256i write = _mm256_and_si256(vIs(dest, r), active);
+        vStore(g->reg[r], vSelect(write, memwbData, vLoad(g->reg[r])));
+    }
+
+    __m256i ifidPcPlus1 = vLoad(g->ifidPcPlus1);
+    __m256i pcPlus1 = _mm256_add_epi32(pc, one);
+    __m256i kill = _mm256_or_si256(stall, squash);
+    vStore(g->wbendInstr, vSelect(active, memwb, wbend));
+    vStore(g->wbendData, vSelect(active, memwbData, vLoad(g->wbendData)));
+    vStore(g->memwbInstr, vSelect(active, exmem, memwb));
+    vStore(g->memwbData, vSelect(active, data, memwbData));
+    vStore(g->exmemInstr, vSelect(active, vSelect(squash, noop, idex), exmem));
+    vStore(g->exmemTarget, vSelect(active, _mm256_add_epi32(vLoad(g->idexPcPlus1), offset), target));
+    vStore(g->exmemEq, vSelect(active, eq, vLoad(g->exmemEq)));
+    vStore(g->exmemAlu, vSelect(active, alu, exmemAlu));
+    vStore(g->exmemValB, vSelect(active, b, vLoad(g->exmemValB)));
+    vStore(g->idexInstr, vSelect(active, vSelect(kill, noop, ifid), idex));
+    vStore(g->idexPcPlus1, vSelect(active, ifidPcPlus1, vLoad(g->idexPcPlus1)));
+    __m256i read = _mm256_andnot_si256(stall, active);
+    vStore(g->idexValA, vSelect(read, valA, vLoad(g->idexValA)));
+    vStore(g->idexValB, vSelect(read, valB, vLoad(g->idexValB)));
+    vStore(g->idexOffset, vSelect(read, _mm256_srai_epi32(_mm256_slli_epi32(ifid, 16), 16), offset));
+    __m256i nextIfid = vSelect(squash, noop, vSelect(stall, ifid, fetched));
+    vStore(g->ifidInstr, vSelect(active, nextIfid, ifid));
+    vStore(g->ifidPcPlus1, vSelect(read, pcPlus1, ifidPcPlus1));
+    __m256i nextPc = vSelect(squash, target, vSelect(stall, pc, pcPlus1));
+    vStore(g->pc, vSelect(active, nextPc, pc));
+    vStore(g->cycles, _mm256_sub_epi32(vLoad(g->cycles), active));
+    return _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(vIs(memOp, HALT), active)));
+}
+#endif
+
+// Run every program through the lane engine, numGroups groups of VLANES
+// lanes, with the AVX2 kernel if avx2 is set. Each program is checked
+// against its scalar run as it halts. Returns the machine-cycles run.
+unsigned long long lanesRun(const lanesType *lanes, int numGroups, int avx2) {
+    laneGroupType *groups = calloc(numGroups, sizeof(laneGroupType));
+    unsigned long long cycles = 0;
+    int next = 0, busy = 0;
+    for (int i = 0; groups && i < numGroups; i++){
+        groups[i].instrMem = calloc((size_t)VLANES * LANE_STRIDE, sizeof(int));
+        groups[i].dataMem = calloc((size_t)VLANES * LANE_STRIDE, sizeof(int));
+        if (!groups[i].instrMem || !groups[i].dataMem){
+            groups = NULL;
+        }
+    }
+    if (!groups){
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    for (int i = 0; i < numGroups; i++){
+        for (int l = 0; l < VLANES; l++){
+            groups[i].program[l] = -1;
+            laneLoad(&groups[i], l, lanes, &next);
+            busy += groups[i].program[l] >= 0;
+        }
+    }
+
+    while (busy) {
+        for (int i = 0; i < numGroups; i++){
+            laneGroupType *g = &groups[i];
+#ifdef LANES_AVX2
+            int halted = avx2 ? laneCycleAvx2(g) : laneCycle(g);
+#else
+            int halted = laneCycle(g);
+#endif
+            for (int l = 0; halted; l++, halted >>= 1){
+                if (halted & 1){
+                    laneCheck(g, l, lanes);
+                    cycles += g->cycles[l];
+                    laneLoad(g, l, lanes, &next);
+                    busy -= g->program[l] < 0;
+                }
+            }
+        }
+    }
+
+    for (int i = 0; i < numGroups; i++){
+        free(groups[i].instrMem);
+        free(groups[i].dataMem);
+    }
+    free(groups);
+    return cycles;
+}
+
+// Run every program through the scalar pipeline one after another, keeping
+// how each ended. Returns the machine-cycles run.
+unsigned long long lanesScalar(lanesType *lanes) {
+    fuzzWorkType *w = calloc(1, sizeof(fuzzWorkType));
+    unsigned long long cycles = 0;
+    if (!w){
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    for (int p = 0; p < lanes->count; p++){
+        int numWords = lanes->start[p + 1] - lanes->start[p];
+        stateType *state = &w->state;
+        int top = numWords;
+        memcpy(w->image, lanes->images + lanes->start[p], numWords * sizeof(int));
+        fuzzLoad(w, numWords);
+        while (opcode(state->MEMWB.instr) != HALT) {
+            runCycle(&defaultConfig, state, &w->newState);
+            if (opcode(w->newState.MEMWB.instr) == SW && state->EXMEM.aluResult >= top){
+                top = state->EXMEM.aluResult + 1;
+            }
+            commitCycle(state, &w->newState);
+        }
+        w->memTop = top;
+        lanes->results[p].cycles = state->cycles;
+        memcpy(lanes->results[p].reg, state->reg, sizeof(state->reg));
+        lanes->results[p].hash = hashWords(state->dataMem, top);
+        cycles += state->cycles;
+    }
+    free(w);
+    return cycles;
+}
+
+int lanesMain(const char *spec) {
+    static int image[NUMMEMORY];
+    lanesType lanes;
+    genType gen;
+    specCheck(spec, LANES_KEYS);
+    genParse(&gen, spec);
+    long count = specValue(spec, "n", 1000);
+    long numLanes = specValue(spec, "lanes", 16);
+    int avx2 = specValue(spec, "simd", 1);
+    if (count < 1 || count > 1000000){
+        printf("error: n must be between 1 and 1000000\n");
+        exit(1);
+    }
+    if (numLanes < VLANES || numLanes > 8 * VLANES || numLanes % VLANES){
+        printf("error: lanes must be a multiple of %d up to %d\n", VLANES, 8 * VLANES);
+        exit(1);
+    }
+#ifdef LANES_AVX2
+    avx2 = avx2 && __builtin_cpu_supports("avx2");
+#else
+    avx2 = 0;
+#endif
+
+    lanes.count = count;
+    lanes.start = malloc((count + 1) * sizeof(int));
+    lanes.results = malloc(count * sizeof(laneResultType));
+    lanes.images = NULL;
+    if (!lanes.start || !lanes.results){
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    lanes.start[0] = 0;
+    for (long p = 0; p < count; p++){
+        genType one = gen;
+        one.seed += p;
+        int numWords = generate(&one, image);
+        lanes.images = realloc(lanes.images, (lanes.start[p] + numWords) * sizeof(int));
+        if (!lanes.images){
+            printf("error: out of memory\n");
+            exit(1);
+        }
+        memcpy(lanes.images + lanes.start[p], image, numWords * sizeof(int));
+        lanes.start[p + 1] = lanes.start[p] + numWords;
+    }
+
+    double start = wallTime();
+    unsigned long long cycles = lanesScalar(&lanes);
+    double scalar = wallTime() - start;
+    printf("lanes: %ld programs, %llu machine-cycles\n", count, cycles);
+    printf("lanes: scalar pipeline %14.2f M machine-cycles/s\n", cycles / scalar / 1e6);
+
+    for (int simd = 0; simd <= avx2; simd++){
+        start = wallTime();
+        lanesRun(&lanes, numLanes / VLANES, simd);
+        double secs = wallTime() - start;
+        printf("lanes: %2ld lanes, %-8s %14.2f M machine-cycles/s, x%.2f\n", numLanes,
+            simd ? "avx2" : "portable", cycles / secs / 1e6, scalar / secs);
+    }
+    free(lanes.images);
+    free(lanes.start);
+    free(lanes.results);
+    return 0;
+}
+
+/* ---------------------- Debugger --------------------- */
+// -debug reads commands from stdin. Breakpoints stop fetch at a pc and
+// watchpoints stop on a sw to a word or a write to a register. Both are
+// bitmaps looked up with the fetch pc, the sw address and the WB register,
+// so setting them costs a few bit tests per cycle however many there are.
+
+#define DEBUG_STALL 1 // break on a load-use stall
+#define DEBUG_SQUASH 2 // on a mispredicted branch
+#define DEBUG_FORWARD 4 // on an operand forwarded into EX
+
+#define DEBUG_RUN 0 // run until something stops it
+#define DEBUG_CYCLE 1 // one cycle
+#define DEBUG_INSTR 2 // until an instruction retires
+
+typedef struct debugStruct {
+    unsigned int breaks[NUMMEMORY / 32]; // pcs
+    unsigned int watches[NUMMEMORY / 32]; // dataMem words
+    int regWatches; // a bit per register
+    int events; // DEBUG_ bits
+} debugType;
+
+static inline int bitTest(const unsigned int *map, int i) {
+    i &= NUMMEMORY - 1;
+    return map[i >> 5] >> (i & 31) & 1;
+}
+
+static inline void bitSet(unsigned int *map, int i) {
+    map[i >> 5] |= 1u << (i & 31);
+}
+
+// print " (label)" if addr has one
+void printLabel(int addr) {
+    const char *label = symbolName(addr);
+    if (label){
+        printf(" (%s)", label);
+    }
+}
+
+// Whether the instruction going into EX this cycle takes an operand it
+// actually reads from a later latch rather than the register file
+int debugForwarded(const stateType *state) {
+    int instr = state->IDEX.instr, op = opcode(instr);
+    int reads0 = op == ADD || op == NOR || op == LW || op == SW || op == BEQ;
+    int reads1 = op == ADD || op == NOR || op == SW || op == BEQ;
+    int producers[3] = { state->WBEND.instr, state->MEMWB.instr, state->EXMEM.instr };
+    if (state->memWait > 0){
+        return 0;
+    }
+    for (int i = 0; i < 3; i++){
+        int dest = destReg(producers[i]);
+        if ((reads0 && field0(instr) == dest) || (reads1 && field1(instr) == dest)){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Run one cycle, saying why if it should stop here. Sets *retired if an
+// instruction retired. Like every debug message, these give the cycle
+// count as it is once the cycle is done.
+int debugCycle(const debugType *d, const configType *config, stateType *state, stateType *newState,
+        int *retired) {
+    int stop = 0;
+    if ((d->events & DEBUG_FORWARD) && debugForwarded(state)){
+        printf("debug: cycle %u: forward into ", state->cycles + 1);
+        printInstruction(state->IDEX.instr);
+        printf("\n");
+        stop = 1;
+    }
+    runCycle(config, state, newState);
+
+    if (opcode(newState->MEMWB.instr) == SW && bitTest(d->watches, state->EXMEM.aluResult)){
+        int addr = state->EXMEM.aluResult;
+        printf("debug: cycle %u: dataMem[ %d ]", newState->cycles, addr);
+        printLabel(addr);
+        printf(" %d -> %d, sw at pc %d\n", state->dataMem[addr], newState->dataMem[addr],
+            state->latchPc[TAG_EXMEM]);
+        stop = 1;
+    }
+    int dest = destReg(newState->WBEND.instr);
+    if (dest >= 0 && dest < NUMREGS && (d->regWatches >> dest & 1)){
+        printf("debug: cycle %u: reg[ %d ] %d -> %d, from pc %d\n", newState->cycles, dest,
+            state->reg[dest], newState->reg[dest], newState->latchPc[TAG_WBEND]);
+        stop = 1;
+    }
+    if ((d->events & DEBUG_STALL) && newState->stats.loadStalls != state->stats.loadStalls){
+        printf("debug: cycle %u: load-use stall\n", newState->cycles);
+        stop = 1;
+    }
+    if ((d->events & DEBUG_SQUASH) && newState->stats.mispredicts != state->stats.mispredicts){
+        printf("debug: cycle %u: branch mispredicted, squashed\n", newState->cycles);
+        stop = 1;
+    }
+    *retired = newState->latchPc[TAG_WBEND] >= 0;
+    commitCycle(state, newState);
+    return stop;
+}
+
+// Run count cycles, or until count instructions retire with DEBUG_INSTR,
+// or on and on with DEBUG_RUN. Returns 1 if a breakpoint, watchpoint or
+// event stopped it first.
+int debugRun(const debugType *d, const configType *config, stateType *state, stateType *newState,
+        int mode, long count) {
+    int resumePc = state->pc; // don't stop again on the breakpoint we're sitting on
+    int retired;
+    while (opcode(state->MEMWB.instr) != HALT) {
+        if (mode != DEBUG_RUN && count <= 0){
+            return 0;
+        }
+        resumePc = state->pc == resumePc ? resumePc : -1;
+        if (state->pc != resumePc && bitTest(d->breaks, state->pc)){
+            printf("debug: cycle %u: breakpoint at pc %d", state->cycles, state->pc);
+            printLabel(state->pc);
+            printf("\n");
+            return 1;
+        }
+        int stop = debugCycle(d, config, state, newState, &retired);
+        if (mode == DEBUG_INSTR && retired){
+            printf("debug: cycle %u: retired pc %d", state->cycles, state->latchPc[TAG_WBEND]);
+            printLabel(state->latchPc[TAG_WBEND]);
+            printf(" ");
+            printInstruction(state->WBEND.instr);
+            printf("\n");
+        }
+        count -= mode == DEBUG_CYCLE || (mode == DEBUG_INSTR && retired);
+        if (stop){
+            return 1;
+        }
+    }
+    printf("debug: machine halted after %u cycles\n", state->cycles);
+    return 0;
+}
+
+// Parse an address or label, -1 (after saying so) if it's neither
+int debugAddr(const char *arg) {
+    char *end;
+    long addr = strtol(arg, &end, 10);
+    if (end == arg || *end){
+        addr = symbolAddr(arg);
+    }
+    if (addr < 0 || addr >= NUMMEMORY){
+        printf("debug: no address or label %s\n", arg);
+        return -1;
+    }
+    return addr;
+}
+
+void debugInfo(const debugType *d) {
+    static const char *events[] = { "stall", "squash", "forward" };
+    for (int i = 0; i < NUMMEMORY; i++){
+        if (bitTest(d->breaks, i)){
+            printf("\tbreak pc %d", i);
+            printLabel(i);
+            printf("\n");
+        }
+        if (bitTest(d->watches, i)){
+            printf("\twatch dataMem[ %d ]", i);
+            printLabel(i);
+            printf("\n");
+        }
+    }
+    for (int i = 0; i < NUMREGS; i++){
+        if (d->regWatches >> i & 1){
+            printf("\twatch reg[ %d ]\n", i);
+        }
+    }
+    for (int i = 0; i < 3; i++){
+        if (d->events >> i & 1){
+            printf("\tbreak on %s\n", events[i]);
+        }
+    }
+}
+
+void debugHelp(void) {
+    printf("\tbreak <pc or label>\tstop before fetching from there\n");
+    printf("\tbreak stall|squash|forward\tstop after a load-use stall, a mispredict or a forward\n");
+    printf("\twatch <address or label>\tstop after a sw to that word\n");
+    printf("\twatch r<n>\tstop after a write to reg n\n");
+    printf("\tdelete\tremove all breakpoints and watchpoints\n");
+    printf("\tinfo\tlist them\n");
+    printf("\tcontinue, step [n], stepi [n]\trun on, run n cycles, run until n instructions retire\n");
+    printf("\tprint\tprint the state\n");
+    printf("\tx <address or label>\tprint a word of data memory\n");
+    printf("\tquit\n");
+}
+
+int debugMain(const configType *config, stateType *state, stateType *newState) {
+    static debugType debug;
+    char line[MAXLINELENGTH];
+    printf("debug: type help for commands\n");
+    for (;;) {
+        char command[MAXLINELENGTH] = "", arg[MAXLINELENGTH] = "";
+        printf("(lc2k) ");
+        fflush(stdout);
+        if (!fgets(line, MAXLINELENGTH, stdin)){
+            printf("\n");
+            return 0;
+        }
+        if (sscanf(line, "%s %s", command, arg) < 1){
+            continue;
+        }
+        long count = arg[0] ? atol(arg) : 1;
+        int addr;
+
+        if (strcmp(command, "break") == 0 || strcmp(command, "b") == 0){
+            if (strcmp(arg, "stall") == 0){
+                debug.events |= DEBUG_STALL;
+            }
+            else if (strcmp(arg, "squash") == 0){
+                debug.events |= DEBUG_SQUASH;
+            }
+            else if (strcmp(arg, "forward") == 0){
+                debug.events |= DEBUG_FORWARD;
+            }
+            else if ((addr = debugAddr(arg)) >= 0){
+                bitSet(debug.breaks, addr);
+            }
+        }
+        else if (strcmp(command, "watch") == 0 || strcmp(command, "w") == 0){
+            if (arg[0] == 'r' && arg[1] >= '0' && arg[1] < '0' + NUMREGS && !arg[2]){
+                debug.regWatches |= 1 << (arg[1] - '0');
+            }
+            else if ((addr = debugAddr(arg)) >= 0){
+                bitSet(debug.watches, addr);
+            }
+        }
+        else if (strcmp(command, "delete") == 0 || strcmp(command, "d") == 0){
+            memset(&debug, 0, sizeof(debug));
+        }
+        else if (strcmp(command, "info") == 0 || strcmp(command, "i") == 0){
+            debugInfo(&debug);
+        }
+        else if (strcmp(command, "continue") == 0 || strcmp(command, "c") == 0){
+            debugRun(&debug, config, state, newState, DEBUG_RUN, 0);
+        }
+        else if (strcmp(command, "step") == 0 || strcmp(command, "s") == 0
+                || strcmp(command, "stepi") == 0 || strcmp(command, "si") == 0){
+            int mode = command[strlen(command) - 1] == 'i' ? DEBUG_INSTR : DEBUG_CYCLE;
+            debugRun(&debug, config, state, newState, mode, count);
+        }
+        else if (strcmp(command, "print") == 0 || strcmp(command, "p") == 0){
+            printState(state);
+        }
+        else if (strcmp(command, "x") == 0){
+            if ((addr = debugAddr(arg)) >= 0){
+                printf("\tdataMem[ %d ]", addr);
+                printLabel(addr);
+                printf(" = %d\n", state->dataMem[addr]);
+            }
+        }
+        else if (strcmp(command, "help") == 0 || strcmp(command, "h") == 0){
+            debugHelp();
+        }
+        else if (strcmp(command, "quit") == 0 || strcmp(command, "q") == 0){
+            return 0;
+        }
+        else{
+            printf("debug: unknown command %s, try help\n", command);
+        }
+    }
+}
+
+/* --------------------- Multi-core -------------------- */
+// -multi runs the program on several pipeline cores sharing data memory,
+// spread over host threads. Each core has its own copy of the memories and
+// sees its own stores at once. The stores every core made during a quantum
+// reach all the copies at the barrier that ends it, in core order, so a
+// word stored by two cores in the same quantum ends up with the higher
+// core's value everywhere. Every core runs exactly quantum cycles between
+// barriers, so results don't depend on the number of threads. A shorter
+// quantum makes stores visible sooner, at the cost of more barriers. Each
+// core starts with its id in reg 7, at its own start pc.
 
-typedef struct EXMEMStruct {
-	int branchTarget;
-    int eq;
-	int aluResult;
-	int valB;
-	int instr;
-} EXMEMType;
+#define MULTI_KEYS CONFIG_KEYS ",cores,quantum,jobs,start,max,scale"
+#define MULTI_MAXCORES 64
 
-typedef struct MEMWBStruct {
-	int writeData;
-    int instr;
-} MEMWBType;
+typedef struct coreStruct {
+    stateType state, newState;
+    int start; // pc
+    int (*log)[2]; // address and value of this quantum's stores
+    int numLog;
+    unsigned long long instrs;
+    int halted; // 1 once halted, -1 if it ran out of cycles
+} coreType;
 
-typedef struct WBENDStruct {
-	int writeData;
-	int instr;
-} WBENDType;
+typedef struct multiStruct {
+    const configType *config;
+    coreType *cores[MULTI_MAXCORES];
+    int numCores;
+    long quantum;
+    unsigned long long maxCycles;
+    int jobs;
+    long quanta;
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+    int waiting; // threads at the barrier
+    unsigned long generation; // barriers passed
+} multiType;
 
-typedef struct stateStruct {
-	int pc;
-	int instrMem[NUMMEMORY];
-	int dataMem[NUMMEMORY];
-	int reg[NUMREGS];
-	unsigned int numMemory;
-	IFIDType IFID;
-	IDEXType IDEX;
-	EXMEMType EXMEM;
-	MEMWBType MEMWB;
-	WBENDType WBEND;
-	unsigned int cycles; // number of cycles run so far
-} stateType;
+typedef struct multiWorkStruct {
+    multiType *multi;
+    int id;
+} multiWorkType;
 
-static inline int opcode(int instruction) {
-    return instruction>>22;
+void multiBarrier(multiType *m) {
+    pthread_mutex_lock(&m->lock);
+    unsigned long generation = m->generation;
+    if (++m->waiting == m->jobs){
+        m->waiting = 0;
+        m->generation++;
+        pthread_cond_broadcast(&m->turn);
+    }
+    while (generation == m->generation) {
+        pthread_cond_wait(&m->turn, &m->lock);
+    }
+    pthread_mutex_unlock(&m->lock);
 }
 
-static inline int field0(int instruction) {
-    return (instruction>>19) & 0x7;
+// Run one core for a quantum, logging its stores
+void multiQuantum(multiType *m, coreType *core) {
+    stateType *state = &core->state;
+    stateType *newState = &core->newState;
+    unsigned int stop = state->cycles + m->quantum;
+    while (!core->halted && state->cycles != stop) {
+        if (opcode(state->MEMWB.instr) == HALT){
+            core->halted = 1;
+            break;
+        }
+        if (state->cycles >= m->maxCycles){
+            core->halted = -1;
+            break;
+        }
+        runCycle(m->config, state, newState);
+        if (opcode(newState->MEMWB.instr) == SW){
+            int addr = state->EXMEM.aluResult;
+            core->log[core->numLog][0] = addr;
+            core->log[core->numLog++][1] = newState->dataMem[addr];
+        }
+        core->instrs += newState->latchPc[TAG_WBEND] >= 0;
+        commitCycle(state, newState);
+    }
 }
 
-static inline int field1(int instruction) {
-    return (instruction>>16) & 0x7;
-}
+void *multiThread(void *arg) {
+    multiWorkType *w = arg;
+    multiType *m = w->multi;
+    for (;;) {
+        for (int c = w->id; c < m->numCores; c += m->jobs){
+            multiQuantum(m, m->cores[c]);
+        }
+        multiBarrier(m);
 
-static inline int field2(int instruction) {
-    return instruction & 0xFFFF;
-}
+        // publish everyone's stores to this thread's cores, and decide
+        // whether to go on while nothing can change the answer
+        int done = 1;
+        for (int c = w->id; c < m->numCores; c += m->jobs){
+            coreType *core = m->cores[c];
+            for (int k = 0; k < m->numCores; k++){
+                const coreType *from = m->cores[k];
+                for (int i = 0; i < from->numLog; i++){
+                    core->state.dataMem[from->log[i][0]] = from->log[i][1];
+                    core->newState.dataMem[from->log[i][0]] = from->log[i][1];
+                }
+            }
+        }
+        for (int c = 0; c < m->numCores; c++){
+            done &= m->cores[c]->halted != 0;
+        }
+        if (w->id == 0){
+            m->quanta++;
+        }
+        multiBarrier(m);
 
-// convert a 16-bit number into a 32-bit Linux integer
-static inline int convertNum(int num) {
-    return num - ( (num & (1<<15)) ? 1<<16 : 0 );
+        for (int c = w->id; c < m->numCores; c += m->jobs){
+            m->cores[c]->numLog = 0;
+        }
+        if (done){
+            return NULL;
+        }
+    }
 }
 
-void printState(stateType*);
-void printInstruction(int);
-void readMachineCode(stateType*, char*);
-
+// Load every core and run them all to the end, returns the seconds taken
+double multiRun(multiType *m, const int *image, int numWords) {
+    pthread_t threads[MULTI_MAXCORES];
+    multiWorkType work[MULTI_MAXCORES];
+    for (int c = 0; c < m->numCores; c++){
+        coreType *core = m->cores[c];
+        stateType *state = &core->state;
+        memset(state->instrMem, 0, sizeof(state->instrMem));
+        memset(state->dataMem, 0, sizeof(state->dataMem));
+        memcpy(state->instrMem, image, numWords * sizeof(int));
+        memcpy(state->dataMem, image, numWords * sizeof(int));
+        state->numMemory = numWords;
+        resetState(state);
+        state->reg[7] = c;
+        state->pc = core->start;
+        core->newState = *state;
+        core->numLog = 0;
+        core->instrs = 0;
+        core->halted = 0;
+    }
+    m->quanta = 0;
+    m->waiting = 0;
 
-int main(int argc, char *argv[]) {
+    double start = wallTime();
+    for (int i = 0; i < m->jobs; i++){
+        work[i].multi = m;
+        work[i].id = i;
+        pthread_create(&threads[i], NULL, multiThread, &work[i]);
+    }
+    for (int i = 0; i < m->jobs; i++){
+        pthread_join(threads[i], NULL);
+    }
+    return wallTime() - start;
+}
 
-    /* Declare state and newState.
-       Note these have static lifetime so that instrMem and
-       dataMem are not allocated on the stack. */
+int multiMain(const char *spec, const char *filename) {
+    static int image[NUMMEMORY];
+    static multiType multi;
+    configType config;
+    long jobs = specValue(spec, "jobs", sysconf(_SC_NPROCESSORS_ONLN));
+    const char *start = specFind(spec, "start");
 
-    static stateType state, newState;
-    
-    if (argc != 2) {
-        printf("error: usage: %s <machine-code file>\n", argv[0]);
+    specCheck(spec, MULTI_KEYS);
+    configParse(&config, spec);
+    int numWords = readImage(filename, image);
+    multi.config = &config;
+    multi.numCores = specValue(spec, "cores", 4);
+    multi.quantum = specValue(spec, "quantum", 1000);
+    multi.maxCycles = specValue(spec, "max", 100000000);
+    if (multi.numCores < 1 || multi.numCores > MULTI_MAXCORES){
+        printf("error: cores must be between 1 and %d\n", MULTI_MAXCORES);
+        exit(1);
+    }
+    if (multi.quantum < 1 || multi.quantum > 1 << 20){
+        printf("error: quantum must be between 1 and %d\n", 1 << 20);
         exit(1);
     }
+    jobs = jobs < 1 ? 1 : jobs;
 
-    readMachineCode(&state, argv[1]);
+    // start pcs are a / list of addresses or labels, the last one repeating
+    int starts[MULTI_MAXCORES], numStarts = 0;
+    while (start && numStarts < MULTI_MAXCORES) {
+        char text[MAXLINELENGTH], *end;
+        int length = strcspn(start, ",/");
+        snprintf(text, sizeof(text), "%.*s", length, start);
+        starts[numStarts] = strtol(text, &end, 10);
+        if (end == text || *end){
+            starts[numStarts] = symbolAddr(text);
+        }
+        if (starts[numStarts] < 0 || starts[numStarts] >= NUMMEMORY){
+            printf("error: bad start %s\n", text);
+            exit(1);
+        }
+        numStarts++;
+        start = start[length] == '/' ? start + length + 1 : NULL;
+    }
+    pthread_mutex_init(&multi.lock, NULL);
+    pthread_cond_init(&multi.turn, NULL);
 
-    // All registers in the processor should be initialized to 0, alongside the program counter.
-    // Initialize registers to 0
-    for (int i = 0; i < NUMREGS; i++){
-        state.reg[i] = 0;
+    for (int c = 0; c < multi.numCores; c++){
+        coreType *core = multi.cores[c] = calloc(1, sizeof(coreType));
+        if (!core || !(core->log = malloc(multi.quantum * sizeof(*core->log)))){
+            printf("error: out of memory\n");
+            exit(1);
+        }
+        core->start = numStarts ? starts[c < numStarts ? c : numStarts - 1] : 0;
     }
-    // program counter is initialized to 0
-    state.pc = 0;
 
-    // The instruction field in all pipeline registers should be initialized to the noop instruction
-    // Initialize pipeline registers to NOOP
-    state.IFID.instr = NOOPINSTR;
-    state.IDEX.instr = NOOPINSTR;
-    state.EXMEM.instr = NOOPINSTR;
-    state.MEMWB.instr = NOOPINSTR;
-    state.WBEND.instr = NOOPINSTR;
+    if (specValue(spec, "scale", 0)){
+        int numCores = multi.numCores;
+        for (int n = 1; n <= numCores; n = n * 2 > numCores && n < numCores ? numCores : n * 2){
+            unsigned long long cycles = 0;
+            multi.numCores = n;
+            multi.jobs = n < jobs ? n : jobs;
+            double secs = multiRun(&multi, image, numWords);
+            for (int c = 0; c < n; c++){
+                cycles += multi.cores[c]->state.cycles;
+            }
+            printf("multi: %2d cores on %2d threads: %10.2f M core-cycles/s, %.3f s\n", n, multi.jobs,
+                cycles / secs / 1e6, secs);
+        }
+        return 0;
+    }
 
-    // Initialize state here
-    state.cycles = 0; // set cycles to 0
+    multi.jobs = multi.numCores < jobs ? multi.numCores : jobs;
+    double secs = multiRun(&multi, image, numWords);
+    unsigned long long cycles = 0;
+    printf("multi: %d cores, quantum %ld cycles, %d threads, %ld quanta, %.3f s\n",
+        multi.numCores, multi.quantum, multi.jobs, multi.quanta, secs);
+    printf("%4s %6s %12s %12s %7s %12s %12s %12s\n", "core", "start", "cycles", "instrs", "CPI",
+        "loadStalls", "memStalls", "mispredicts");
+    for (int c = 0; c < multi.numCores; c++){
+        const coreType *core = multi.cores[c];
+        const stateType *state = &core->state;
+        cycles += state->cycles;
+        printf("%4d %6d %12u %12llu %7.3f %12llu %12llu %12llu%s\n", c, core->start, state->cycles,
+            core->instrs, core->instrs ? (double)state->cycles / core->instrs : 0.0,
+            state->stats.loadStalls, state->stats.memStalls, state->stats.mispredicts,
+            core->halted < 0 ? "  (didn't halt)" : "");
+    }
+    for (int c = 0; c < multi.numCores; c++){
+        printf("core %d regs:", c);
+        for (int i = 0; i < NUMREGS; i++){
+            printf(" %d", multi.cores[c]->state.reg[i]);
+        }
+        printf("\n");
+    }
+    printf("multi: %.2f M core-cycles/s\n", cycles / secs / 1e6);
+    return 0;
+}
 
-    // detect and forward destinations
-    int EXEM_det_and_forward = 0;
-    int MEMWB_det_and_forward = 0;
-    int WBEND_det_and_forward = 0;
+/* ------------------- Memory profile ------------------ */
+// -memprof runs the pipeline and follows two access streams: the words IF
+// reads from instrMem every cycle, stalls and wrong paths included, and the
+// words MEM reads and writes in dataMem. For each stream it keeps a
+// histogram of LRU stack distances. That is the number of distinct other
+// words touched since the last access to the same word, found with a
+// Fenwick tree over access times that holds a 1 at each word's latest time.
+// A fully associative LRU cache of C words hits exactly the accesses with
+// a distance below C. So one run gives the miss rate of every size.
 
+#define MEMPROF_KEYS CONFIG_KEYS ",window,top,out"
+#define REUSE_TIMES (1 << 20) // access times before they are renumbered
 
+typedef struct streamStruct {
+    const char *name;
+    int last[NUMMEMORY]; // time of each word's latest access, -1 if none
+    int owner[REUSE_TIMES + 1]; // the word accessed at each time
+    int tree[REUSE_TIMES + 1]; // Fenwick tree, 1-based
+    int now; // times used so far
+    unsigned long long distances[NUMMEMORY]; // accesses at each stack distance
+    unsigned long long counts[NUMMEMORY]; // accesses to each word
+    unsigned long long accesses;
+    int distinct; // words touched, each of them once a cold miss
+    // working set: distinct words touched in each window of cycles
+    int windowOf[NUMMEMORY]; // last window each word was touched in
+    int window;
+    int inWindow;
+    long windows;
+    unsigned long long windowSum;
+    int windowMin, windowMax;
+} streamType;
 
+static inline void treeAdd(streamType *s, int time, int delta) {
+    for (int i = time + 1; i <= REUSE_TIMES; i += i & -i) {
+        s->tree[i] += delta;
+    }
+}
 
-    while (opcode(state.MEMWB.instr) != HALT) {
-        printState(&state);
+// The number of 1s at times before time
+static inline int treeSum(const streamType *s, int time) {
+    int sum = 0;
+    for (int i = time; i > 0; i -= i & -i) {
+        sum += s->tree[i];
+    }
+    return sum;
+}
 
-        newState = state;
-        newState.cycles += 1;
-        
-
-        /* ---------------------- IF stage --------------------- */
-        // IF = Instruction Fetch
-        newState.IFID.instr = state.instrMem[state.pc];  // new state stage gets instruction from memory
-        newState.IFID.pcPlus1 = state.pc + 1; 
-        newState.pc++; // increment pc
-
-
-        /* ---------------------- ID stage --------------------- */
-        // ID = Instruction Decode
-        newState.IDEX.instr = state.IFID.instr; // new state stage gets instruction from previous stage
-        newState.IDEX.pcPlus1 = state.IFID.pcPlus1; // new state stage gets pcPlus1 from previous stage
-
-        // hazard potential LW
-        if (opcode(state.IDEX.instr) == LW){
-            // check if field0 newstate and field1 state are the same
-            // then check if field1 newstate and field1 state are the same
-            // also check if field0 newstate and field1 state are the same
-            // if either are the same, then stall with noop
-            if (field1(newState.IDEX.instr) == field1(state.IDEX.instr) || field0(newState.IDEX.instr) == field1(state.IDEX.instr)){
-                // if they are the same, then stall with noop
-                newState.pc = state.pc; // unincriment pc
-                newState.IFID = state.IFID; // set state instruction
-                newState.IDEX.instr = NOOPINSTR; // give noop this cycle
-            }
-            else{ // no data hazard
-            // get register values and offset for LW and send them to next stage
-            newState.IDEX.valA = state.reg[field0(state.IFID.instr)];
-            newState.IDEX.valB = state.reg[field1(state.IFID.instr)];
-            newState.IDEX.offset = convertNum(field2(state.IFID.instr));
-            }
+void streamInit(streamType *s, const char *name) {
+    memset(s, 0, sizeof(*s));
+    s->name = name;
+    memset(s->last, -1, sizeof(s->last));
+    memset(s->windowOf, -1, sizeof(s->windowOf));
+    s->windowMin = NUMMEMORY;
+}
+
+// Out of times: give the live ones 0, 1, 2... in order, and rebuild the
+// tree in place. At most NUMMEMORY times are live, so this is rare.
+void streamRenumber(streamType *s) {
+    int next = 0;
+    for (int t = 0; t < s->now; t++){
+        int addr = s->owner[t];
+        if (s->last[addr] == t){
+            s->last[addr] = next;
+            s->owner[next++] = addr;
         }
-        else{ // no data hazard
-            // get register values and offset for LW and send them to next stage
-            newState.IDEX.valA = state.reg[field0(state.IFID.instr)];
-            newState.IDEX.valB = state.reg[field1(state.IFID.instr)];
-            newState.IDEX.offset = convertNum(field2(state.IFID.instr));
+    }
+    s->now = next;
+    memset(s->tree, 0, sizeof(s->tree));
+    for (int i = 1; i <= REUSE_TIMES; i++){
+        s->tree[i] += i <= next;
+        int parent = i + (i & -i);
+        if (parent <= REUSE_TIMES){
+            s->tree[parent] += s->tree[i];
         }
+    }
+}
 
+void streamWindow(streamType *s) {
+    if (s->inWindow == 0){
+        return;
+    }
+    s->windows++;
+    s->windowSum += s->inWindow;
+    s->windowMin = s->inWindow < s->windowMin ? s->inWindow : s->windowMin;
+    s->windowMax = s->inWindow > s->windowMax ? s->inWindow : s->windowMax;
+    s->inWindow = 0;
+}
 
-        /* ---------------------- EX stage --------------------- */
-        // EX = Execute
-        newState.EXMEM.instr = state.IDEX.instr; // new state stage gets instruction from previous stage
-        newState.EXMEM.branchTarget = state.IDEX.pcPlus1 + state.IDEX.offset; // set branch target if needed
-        // int writeBackDestReg = 0; // set destination register to 0
-        // int memDestReg = 0; // set destination register to 0
-        // int exmemDestReg = 0; // set destination register to 0
-        // NOW DECLARED OUTSIDE LOOP
-        int reg0Value = state.IDEX.valA; // set reg0Value so that the value can be used and not be overwritten
-        int reg1Value = state.IDEX.valB; // set reg1Value so that the value can be used and not be overwritten
+void streamAccess(streamType *s, int addr, int window) {
+    if (window != s->window){
+        streamWindow(s);
+        s->window = window;
+    }
+    if (s->windowOf[addr] != window){
+        s->windowOf[addr] = window;
+        s->inWindow++;
+    }
 
-        // if LW for write back state instruction set destination register to field1
-        if (opcode(state.WBEND.instr) == LW){
-            WBEND_det_and_forward = field1(state.WBEND.instr);
-        }
-        else { // instruction is anythting but LW so set destination register to field2
-            WBEND_det_and_forward = field2(state.WBEND.instr);
-        }
+    if (s->now == REUSE_TIMES){
+        streamRenumber(s);
+    }
+    int last = s->last[addr];
+    if (last < 0){
+        s->distinct++;
+    }
+    else{
+        s->distances[treeSum(s, s->now) - treeSum(s, last + 1)]++;
+        treeAdd(s, last, -1);
+    }
+    treeAdd(s, s->now, 1);
+    s->last[addr] = s->now;
+    s->owner[s->now++] = addr;
+    s->counts[addr]++;
+    s->accesses++;
+}
 
-        // repeat for MEMWB
-        if (opcode(state.MEMWB.instr) == LW){
-            MEMWB_det_and_forward = field1(state.MEMWB.instr);
-        }
-        else {
-            MEMWB_det_and_forward = field2(state.MEMWB.instr);
-        }
+// Misses of a fully associative LRU cache of size words
+unsigned long long streamMisses(const streamType *s, int size) {
+    unsigned long long hits = 0;
+    for (int d = 0; d < size && d < NUMMEMORY; d++){
+        hits += s->distances[d];
+    }
+    return s->accesses - hits;
+}
 
-        // repeat for EXMEM
-        if (opcode(state.EXMEM.instr) == LW){
-            EXEM_det_and_forward = field1(state.EXMEM.instr);
+void streamReport(const streamType *s, int top, unsigned long long windowCycles) {
+    printf("%s: %llu accesses to %d words\n", s->name, s->accesses, s->distinct);
+    if (s->accesses == 0){
+        return;
+    }
+    printf("  stack distance  accesses   percent\n");
+    for (int lo = 0; lo < NUMMEMORY; lo = lo ? lo * 2 : 1){
+        int hi = lo ? lo * 2 - 1 : 0;
+        unsigned long long n = 0;
+        for (int d = lo; d <= hi; d++){
+            n += s->distances[d];
         }
-        else {
-            EXEM_det_and_forward = field2(state.EXMEM.instr);
+        if (n){
+            char range[32];
+            snprintf(range, sizeof(range), lo == hi ? "%d" : "%d-%d", lo, hi);
+            printf("  %-14s %9llu  %7.3f%%\n", range, n, 100.0 * n / s->accesses);
         }
+    }
+    printf("  %-14s %9d  %7.3f%%\n", "cold", s->distinct, 100.0 * s->distinct / s->accesses);
 
-        // data hazard branching time
-        // idea is forward and correct later
-        // add, nor, lw can cause
-        if (opcode(state.WBEND.instr) == ADD || opcode(state.WBEND.instr) == NOR || opcode(state.WBEND.instr) == LW){
-            // if write back destination matches field0 or field1 of new state instruction
-            if (field0(newState.EXMEM.instr) == WBEND_det_and_forward){
-                // set reg0Value to write back value
-                reg0Value = state.WBEND.writeData;
-            }
-            if (field1(newState.EXMEM.instr) == WBEND_det_and_forward){
-                // set reg1Value to write back value
-                reg1Value = state.WBEND.writeData;
-            }
+    printf("  cache words     misses miss rate\n");
+    for (int size = 1; ; size *= 2){
+        unsigned long long misses = streamMisses(s, size);
+        printf("  %-14d %9llu  %7.3f%%\n", size, misses, 100.0 * misses / s->accesses);
+        if (size >= s->distinct){
+            break;
         }
+    }
 
-        // repeate for MEMWB
-        if (opcode(state.MEMWB.instr) == ADD || opcode(state.MEMWB.instr) == NOR || opcode(state.MEMWB.instr) == LW){
-            // if write back destination matches field0 or field1 of new state instruction
-            if (field0(newState.EXMEM.instr) == MEMWB_det_and_forward){
-                // set reg0Value to write back value
-                reg0Value = state.MEMWB.writeData;
-            }
-            if (field1(newState.EXMEM.instr) == MEMWB_det_and_forward){
-                // set reg1Value to write back value
-                reg1Value = state.MEMWB.writeData;
+    printf("  working set per %llu cycles: min %d, mean %.1f, max %d words over %ld windows\n",
+        windowCycles, s->windowMin, (double)s->windowSum / s->windows, s->windowMax, s->windows);
+
+    // the top hottest words, by selection since top is small
+    static unsigned char shown[NUMMEMORY];
+    memset(shown, 0, sizeof(shown));
+    printf("  hottest:\n");
+    for (int i = 0; i < top && i < s->distinct; i++){
+        int best = -1;
+        for (int addr = 0; addr < NUMMEMORY; addr++){
+            if (!shown[addr] && s->counts[addr] && (best < 0 || s->counts[addr] > s->counts[best])){
+                best = addr;
             }
         }
+        shown[best] = 1;
+        printf("  %8d %9llu  %7.3f%%", best, s->counts[best], 100.0 * s->counts[best] / s->accesses);
+        printLabel(best);
+        printf("\n");
+    }
+}
 
-        // repeate for EXMEM
-        if (opcode(state.EXMEM.instr) == ADD || opcode(state.EXMEM.instr) == NOR || opcode(state.EXMEM.instr) == LW){
-            // if write back destination matches field0 or field1 of new state instruction
-            if (field0(newState.EXMEM.instr) == EXEM_det_and_forward){
-                // set reg0Value to write back value
-                reg0Value = state.EXMEM.aluResult;
-            }
-            if (field1(newState.EXMEM.instr) == EXEM_det_and_forward){
-                // set reg1Value to write back value
-                reg1Value = state.EXMEM.aluResult;
+int memprofMain(const char *spec, const char *filename) {
+    static stateType state, newState;
+    static streamType fetches, data;
+    configType config;
+    unsigned long long windowCycles = specValue(spec, "window", 10000);
+    int top = specValue(spec, "top", 10);
+    const char *outName = specFind(spec, "out");
+
+    specCheck(spec, MEMPROF_KEYS);
+    configParse(&config, spec);
+    if (windowCycles == 0){
+        printf("error: window must be at least 1\n");
+        exit(1);
+    }
+    state.numMemory = readImage(filename, state.instrMem);
+    memcpy(state.dataMem, state.instrMem, state.numMemory * sizeof(int));
+    resetState(&state);
+    newState = state;
+    streamInit(&fetches, "fetch");
+    streamInit(&data, "data");
+
+    double start = wallTime();
+    while (opcode(state.MEMWB.instr) != HALT) {
+        int window = state.cycles / windowCycles;
+        int stalled = state.memWait > 0; // neither IF nor MEM does anything
+        if (!stalled && (state.pc < 0 || state.pc >= NUMMEMORY)){
+            printf("error: fetch out of range at pc %d\n", state.pc);
+            exit(1);
+        }
+        runCycle(&config, &state, &newState);
+        if (!stalled){
+            streamAccess(&fetches, state.pc, window);
+            int op = opcode(newState.MEMWB.instr);
+            if (op == LW || op == SW){
+                streamAccess(&data, state.EXMEM.aluResult, window);
             }
         }
+        commitCycle(&state, &newState);
+    }
+    streamWindow(&fetches);
+    streamWindow(&data);
+    double secs = wallTime() - start;
 
+    printf("memprof: %u cycles, %.3f s\n", state.cycles, secs);
+    streamReport(&fetches, top, windowCycles);
+    streamReport(&data, top, windowCycles);
 
-        // determine aluResult based on opcode
-        if (opcode(newState.EXMEM.instr) == ADD){ // is ADD
-            newState.EXMEM.aluResult = reg0Value + reg1Value; // set aluResult to reg0Value + reg1Value (aka add)
+    // the whole miss-rate curve, every size up to where it flattens out
+    if (outName){
+        char name[256];
+        snprintf(name, sizeof(name), "%.*s", (int)strcspn(outName, ","), outName);
+        FILE *out = fopen(name, "w");
+        if (!out){
+            printf("error: can't open file %s\n", name);
+            exit(1);
         }
-        else if (opcode(newState.EXMEM.instr) == LW || opcode(newState.EXMEM.instr) == SW){ // is LW
-            newState.EXMEM.aluResult = reg0Value + state.IDEX.offset; // set aluResult to reg0Value + current state offset
+        int sizes = fetches.distinct > data.distinct ? fetches.distinct : data.distinct;
+        unsigned long long fetchMisses = fetches.accesses, dataMisses = data.accesses;
+        fprintf(out, "words,fetchMisses,fetchMissRate,dataMisses,dataMissRate\n");
+        for (int size = 1; size <= sizes; size++){
+            fetchMisses -= fetches.distances[size - 1];
+            dataMisses -= data.distances[size - 1];
+            fprintf(out, "%d,%llu,%.6f,%llu,%.6f\n", size,
+                fetchMisses, fetches.accesses ? (double)fetchMisses / fetches.accesses : 0,
+                dataMisses, data.accesses ? (double)dataMisses / data.accesses : 0);
         }
-        else if (opcode(newState.EXMEM.instr) == BEQ){ // is BEQ
-            newState.EXMEM.aluResult = reg0Value - reg1Value; // set aluResult to reg0Value - reg1Value (cause beq magic)
-            // if reg0Value == reg1Value
-            if (reg0Value == reg1Value){
-                newState.EXMEM.eq = 1; // set eq to 1
+        fclose(out);
+    }
+    return 0;
+}
+
+/* ------------- Incremental re-simulation ------------- */
+// With -q -r, a run leaves <file>.ckpt behind. It holds the image, the
+// state every so often, and for every word the first cycle that fetched it,
+// loaded it and stored to it. The next -q -r run diffs its image against
+// the saved one. A checkpoint taken before any changed word was fetched,
+// or loaded before being stored to, has seen none of the edit, so the run
+// resumes from the latest such checkpoint. Words not yet stored to by then
+// take the new image's values. The halted state is kept as the last
+// checkpoint, so a file edited only where the run never looks doesn't run
+// at all.
+
+#define CKPT_MAGIC "LC2KCKP1"
+#define CKPT_MAX 64 // past this many checkpoints, every other one is dropped
+#define CKPT_FIRST 1024 // cycles between checkpoints to begin with
+#define CKPT_NEVER 0xFFFFFFFFu
+#define CKPT_TAIL (sizeof(stateType) - offsetof(stateType, reg)) // the state after dataMem
+
+typedef struct checkpointStruct {
+    unsigned int cycles;
+    int pc;
+    unsigned int memTop; // dataMem words saved
+    int *dataMem;
+    unsigned char tail[CKPT_TAIL];
+} checkpointType;
+
+typedef struct incrementalStruct {
+    configType config;
+    unsigned int hash;
+    unsigned int numWords;
+    int image[NUMMEMORY];
+    // first cycle each word was fetched, loaded and stored to, CKPT_NEVER if not yet
+    unsigned int fetched[NUMMEMORY];
+    unsigned int loaded[NUMMEMORY];
+    unsigned int stored[NUMMEMORY];
+    unsigned int memTop; // past the highest word stored to, at least numWords
+    checkpointType checkpoints[CKPT_MAX];
+    int numCheckpoints;
+    unsigned int interval; // cycles between checkpoints
+    double cycleSeconds; // how long a cycle took to simulate last time
+} incrementalType;
+
+void checkpointTake(incrementalType *inc, const stateType *state) {
+    if (inc->numCheckpoints == CKPT_MAX){
+        for (int i = 0; i < CKPT_MAX; i++){
+            if (i % 2 == 0){
+                free(inc->checkpoints[i].dataMem);
             }
-            else{ // reg0Value != reg1Value
-                newState.EXMEM.eq = 0; // set eq to 0
+            else{
+                inc->checkpoints[i / 2] = inc->checkpoints[i];
             }
+        }
+        inc->numCheckpoints /= 2;
+        inc->interval *= 2;
+    }
+    checkpointType *c = &inc->checkpoints[inc->numCheckpoints++];
+    c->cycles = state->cycles;
+    c->pc = state->pc;
+    c->memTop = inc->memTop;
+    c->dataMem = malloc(c->memTop * sizeof(int));
+    if (!c->dataMem){
+        printf("error: out of memory\n");
+        exit(1);
+    }
+    memcpy(c->dataMem, state->dataMem, c->memTop * sizeof(int));
+    memcpy(c->tail, &state->reg, CKPT_TAIL);
+}
+
+// Load c into state, which holds the new image
+void checkpointRestore(const incrementalType *inc, const checkpointType *c, stateType *state) {
+    unsigned int numMemory = state->numMemory;
+    state->pc = c->pc;
+    memcpy(&state->reg, c->tail, CKPT_TAIL);
+    state->numMemory = numMemory;
+    for (unsigned int addr = 0; addr < c->memTop; addr++){
+        if (inc->stored[addr] < c->cycles){
+            state->dataMem[addr] = c->dataMem[addr];
+        }
+    }
+}
+
+static inline int ckptRead(FILE *in, void *data, size_t size) {
+    return fread(data, 1, size, in) == size;
+}
 
+// Read name into inc. Returns 0 if it is missing, damaged, or from
+// another config or build.
+int incrementalLoad(incrementalType *inc, const char *name, const configType *config) {
+    char magic[8];
+    unsigned int stateSize, top = 0;
+    FILE *in = fopen(name, "rb");
+    if (!in){
+        return 0;
+    }
+    int ok = ckptRead(in, magic, 8) && memcmp(magic, CKPT_MAGIC, 8) == 0
+        && ckptRead(in, &stateSize, sizeof(stateSize)) && stateSize == sizeof(stateType)
+        && ckptRead(in, &inc->config, sizeof(configType)) && memcmp(&inc->config, config, sizeof(configType)) == 0
+        && ckptRead(in, &inc->hash, sizeof(inc->hash))
+        && ckptRead(in, &inc->numWords, sizeof(inc->numWords)) && inc->numWords <= NUMMEMORY
+        && ckptRead(in, inc->image, inc->numWords * sizeof(int))
+        && ckptRead(in, &top, sizeof(top)) && top <= NUMMEMORY
+        && ckptRead(in, inc->fetched, top * sizeof(int))
+        && ckptRead(in, inc->loaded, top * sizeof(int))
+        && ckptRead(in, inc->stored, top * sizeof(int))
+        && ckptRead(in, &inc->interval, sizeof(inc->interval))
+        && ckptRead(in, &inc->cycleSeconds, sizeof(inc->cycleSeconds))
+        && ckptRead(in, &inc->numCheckpoints, sizeof(inc->numCheckpoints))
+        && inc->numCheckpoints > 0 && inc->numCheckpoints <= CKPT_MAX;
+    for (int i = 0; ok && i < inc->numCheckpoints; i++){
+        checkpointType *c = &inc->checkpoints[i];
+        c->dataMem = NULL;
+        ok = ckptRead(in, &c->cycles, sizeof(c->cycles))
+            && ckptRead(in, &c->pc, sizeof(c->pc))
+            && ckptRead(in, &c->memTop, sizeof(c->memTop)) && c->memTop <= NUMMEMORY
+            && (c->dataMem = malloc(c->memTop * sizeof(int) + 1)) != NULL
+            && ckptRead(in, c->dataMem, c->memTop * sizeof(int))
+            && ckptRead(in, c->tail, CKPT_TAIL);
+        if (!ok){
+            inc->numCheckpoints = i + 1;
         }
-        else if (opcode(newState.EXMEM.instr) == NOR){ // is NOR
-            newState.EXMEM.aluResult = ~(reg0Value | reg1Value); // set aluResult to ~(reg0Value | reg1Value) (aka bitwise nor)
-            // print result
-            //printf("nor result: %d\n", newState.EXMEM.aluResult);
+    }
+    fclose(in);
+    for (unsigned int addr = top; addr < NUMMEMORY; addr++){
+        inc->fetched[addr] = inc->loaded[addr] = inc->stored[addr] = CKPT_NEVER;
+    }
+    if (!ok){
+        for (int i = 0; i < inc->numCheckpoints; i++){
+            free(inc->checkpoints[i].dataMem);
         }
+        inc->numCheckpoints = 0;
+    }
+    return ok;
+}
 
-        if (opcode(newState.EXMEM.instr) != NOOP){ // not a NOOP
-            newState.EXMEM.valB = reg1Value; // set valB to reg1Value
+void incrementalSave(const incrementalType *inc, const char *name) {
+    unsigned int stateSize = sizeof(stateType), top = 0;
+    FILE *out = fopen(name, "wb");
+    if (!out){
+        printf("error: can't open file %s\n", name);
+        exit(1);
+    }
+    for (unsigned int addr = 0; addr < NUMMEMORY; addr++){
+        if (inc->fetched[addr] != CKPT_NEVER || inc->loaded[addr] != CKPT_NEVER || inc->stored[addr] != CKPT_NEVER){
+            top = addr + 1;
         }
-        else{
-            newState.EXMEM.aluResult = 0; // reset valB to 0
+    }
+    fwrite(CKPT_MAGIC, 8, 1, out);
+    fwrite(&stateSize, sizeof(stateSize), 1, out);
+    fwrite(&inc->config, sizeof(configType), 1, out);
+    fwrite(&inc->hash, sizeof(inc->hash), 1, out);
+    fwrite(&inc->numWords, sizeof(inc->numWords), 1, out);
+    fwrite(inc->image, sizeof(int), inc->numWords, out);
+    fwrite(&top, sizeof(top), 1, out);
+    fwrite(inc->fetched, sizeof(int), top, out);
+    fwrite(inc->loaded, sizeof(int), top, out);
+    fwrite(inc->stored, sizeof(int), top, out);
+    fwrite(&inc->interval, sizeof(inc->interval), 1, out);
+    fwrite(&inc->cycleSeconds, sizeof(inc->cycleSeconds), 1, out);
+    fwrite(&inc->numCheckpoints, sizeof(inc->numCheckpoints), 1, out);
+    for (int i = 0; i < inc->numCheckpoints; i++){
+        const checkpointType *c = &inc->checkpoints[i];
+        fwrite(&c->cycles, sizeof(c->cycles), 1, out);
+        fwrite(&c->pc, sizeof(c->pc), 1, out);
+        fwrite(&c->memTop, sizeof(c->memTop), 1, out);
+        fwrite(c->dataMem, sizeof(int), c->memTop, out);
+        fwrite(c->tail, CKPT_TAIL, 1, out);
+    }
+    if (fclose(out) != 0){
+        printf("error: can't write file %s\n", name);
+        exit(1);
+    }
+}
+
+// The last cycle a checkpoint can be from and not have seen the edit
+unsigned int incrementalLimit(const incrementalType *inc, const stateType *state) {
+    unsigned int limit = CKPT_NEVER;
+    unsigned int numWords = inc->numWords > state->numMemory ? inc->numWords : state->numMemory;
+    if (inc->hash == hashWords(state->instrMem, state->numMemory) && inc->numWords == state->numMemory){
+        return limit;
+    }
+    for (unsigned int addr = 0; addr < numWords; addr++){
+        int old = addr < inc->numWords ? inc->image[addr] : 0;
+        if (old != state->instrMem[addr]){
+            unsigned int first = inc->fetched[addr];
+            if (inc->loaded[addr] < inc->stored[addr] && inc->loaded[addr] < first){
+                first = inc->loaded[addr];
+            }
+            limit = first < limit ? first : limit;
         }
+    }
+    return limit;
+}
 
-        /* --------------------- MEM stage --------------------- */
-        // MEM = Memory access
-        newState.MEMWB.instr = state.EXMEM.instr; // new state stage gets instruction from previous stage
-        // newState.MEMWB.writeData = state.EXMEM.aluResult; // new state stage gets aluResult from previous stage
+// Run to the halt from the latest usable checkpoint in filename's cache,
+// then save a new cache
+void simulateIncremental(const configType *config, stateType *state, stateType *newState, const char *filename) {
+    static incrementalType inc;
+    char name[MAXLINELENGTH];
+    snprintf(name, sizeof(name), "%s.ckpt", filename);
 
-        // opcode operations
-        if (opcode(newState.MEMWB.instr) == LW){
-            newState.MEMWB.writeData = state.dataMem[state.EXMEM.aluResult]; // set writeData to dataMem at aluResult
+    unsigned int from = 0;
+    int cached = incrementalLoad(&inc, name, config);
+    if (cached){
+        // checkpoints only get used if they are before the limit, so
+        // everything from the limit on is out of date
+        unsigned int limit = incrementalLimit(&inc, state);
+        while (inc.numCheckpoints > 0 && inc.checkpoints[inc.numCheckpoints - 1].cycles > limit) {
+            free(inc.checkpoints[--inc.numCheckpoints].dataMem);
+        }
+        cached = inc.numCheckpoints > 0;
+    }
+    if (cached){
+        const checkpointType *c = &inc.checkpoints[inc.numCheckpoints - 1];
+        from = c->cycles;
+        checkpointRestore(&inc, c, state);
+        *newState = *state;
+    }
+    else{
+        inc.numCheckpoints = 0;
+        inc.interval = CKPT_FIRST;
+        inc.cycleSeconds = 0;
+    }
+    inc.config = *config;
+    inc.hash = hashWords(state->instrMem, state->numMemory);
+    inc.numWords = state->numMemory;
+    memcpy(inc.image, state->instrMem, state->numMemory * sizeof(int));
+    inc.memTop = state->numMemory;
+    for (unsigned int addr = 0; addr < NUMMEMORY; addr++){
+        if (!cached || inc.fetched[addr] >= from){
+            inc.fetched[addr] = CKPT_NEVER;
+        }
+        if (!cached || inc.loaded[addr] >= from){
+            inc.loaded[addr] = CKPT_NEVER;
         }
-        else if (opcode(newState.MEMWB.instr) == SW){ 
-            // memory is changed in this stage and the location was calculated in the previous stage through the alu
-            newState.dataMem[state.EXMEM.aluResult] = state.EXMEM.valB; // set dataMem at aluResult to valB
+        if (!cached || inc.stored[addr] >= from){
+            inc.stored[addr] = CKPT_NEVER;
         }
-        else if (opcode(newState.MEMWB.instr) == BEQ){
-            // branch could have already been taken in the previous stage
-            // if (state.EXMEM.aluResult == 0){ // if aluResult is 0
-            //     // fill pipline with noops so control hazard doesnt occur
-            //     newState.IFID.instr = NOOPINSTR; // set IFID instruction to NOOP
-            //     newState.IDEX.instr = NOOPINSTR; // set IDEX instruction to NOOP
-            //     newState.EXMEM.instr = NOOPINSTR; // set EXMEM instruction to NOOP
-            //     newState.pc = state.EXMEM.branchTarget; // set pc to branchTarget
-            // }
+        if (inc.stored[addr] != CKPT_NEVER && addr >= inc.memTop){
+            inc.memTop = addr + 1;
+        }
+    }
 
-            // check using eq 
-            if (state.EXMEM.eq == 1){ // if eq is true
-                // fill pipline with noops so control hazard doesnt occur
-                newState.IFID.instr = NOOPINSTR; // set IFID instruction to NOOP
-                newState.IDEX.instr = NOOPINSTR; // set IDEX instruction to NOOP
-                newState.EXMEM.instr = NOOPINSTR; // set EXMEM instruction to NOOP
-                newState.pc = state.EXMEM.branchTarget; // set pc to branchTarget
-            }
+    double start = wallTime();
+    unsigned int next = state->cycles + (cached ? inc.interval : 0);
+    while (opcode(state->MEMWB.instr) != HALT) {
+        unsigned int cycle = state->cycles;
+        if (cycle == next){
+            checkpointTake(&inc, state);
+            next = cycle + inc.interval;
         }
-        else if (opcode(newState.MEMWB.instr) != NOOP && opcode(newState.MEMWB.instr) != HALT){ // all instructions except noop and halt
-            newState.MEMWB.writeData = state.EXMEM.aluResult; // set writeData to aluResult
+        int stalled = state->memWait > 0; // neither IF nor MEM does anything
+        if (!stalled && state->pc >= 0 && state->pc < NUMMEMORY && inc.fetched[state->pc] == CKPT_NEVER){
+            inc.fetched[state->pc] = cycle;
         }
-        else{
-            newState.MEMWB.writeData = 0; // reset writeData to 0
+        runCycle(config, state, newState);
+        int op = opcode(newState->MEMWB.instr);
+        int addr = state->EXMEM.aluResult;
+        if (!stalled && (op == LW || op == SW) && addr >= 0 && addr < NUMMEMORY){
+            unsigned int *first = op == LW ? &inc.loaded[addr] : &inc.stored[addr];
+            if (*first == CKPT_NEVER){
+                *first = cycle;
+            }
+            if (op == SW && (unsigned int)addr >= inc.memTop){
+                inc.memTop = addr + 1;
+            }
         }
+        commitCycle(state, newState);
+    }
+    if (inc.numCheckpoints == 0 || inc.checkpoints[inc.numCheckpoints - 1].cycles != state->cycles){
+        checkpointTake(&inc, state);
+    }
+    double secs = wallTime() - start;
 
-        /* ---------------------- WB stage --------------------- */
-        // WB = Register write back
-        newState.WBEND.instr = state.MEMWB.instr; // new state stage gets instruction from previous stage
-        newState.WBEND.writeData = state.MEMWB.writeData; // new state stage gets writeData from previous stage
+    unsigned int ran = state->cycles - from;
+    if (ran > 0){
+        inc.cycleSeconds = secs / ran;
+    }
+    incrementalSave(&inc, name);
+    if (cached){
+        fprintf(stderr, "resume: from cycle %u of %u, %.1f%% not rerun, %.3f s, about %.3f s saved\n",
+            from, state->cycles, 100.0 * from / state->cycles, secs, from * inc.cycleSeconds);
+    }
+    else{
+        fprintf(stderr, "resume: no usable checkpoint in %s, ran all %u cycles in %.3f s\n", name, state->cycles, secs);
+    }
+    for (int i = 0; i < inc.numCheckpoints; i++){
+        free(inc.checkpoints[i].dataMem);
+    }
+}
+
+void usage(char *name) {
+    printf("error: usage: %s [-c] [-q [-l | -r] | -f | -debug] [-p key=value,...] <machine-code file>\n", name);
+    printf("       %s -gen key=value,...   keys: " GEN_KEYS "\n", name);
+    printf("       %s -fuzz key=value,...  keys: n,jobs," GEN_KEYS "," CONFIG_KEYS "\n", name);
+    printf("       %s -bench key=value,... <machine-code file>...  keys: " BENCH_KEYS "\n", name);
+    printf("       %s -sweep key=value/value/...,... <machine-code or trace file>  keys: " SWEEP_KEYS "\n", name);
+    printf("       %s -trace <trace file> <machine-code file>\n", name);
+    printf("       %s -sample key=value,... <machine-code file>  keys: " SAMPLE_KEYS "\n", name);
+    printf("       %s -lanes key=value,...  keys: " LANES_KEYS "\n", name);
+    printf("       %s -multi key=value,... <machine-code file>  keys: " MULTI_KEYS "\n", name);
+    printf("       %s -memprof key=value,... <machine-code file>  keys: " MEMPROF_KEYS "\n", name);
+    printf("\t-c\tcheck every retired instruction against a functional model\n");
+    printf("\t-q\tquiet: only print the final state\n");
+    printf("\t-l\twith -q, run loops whose timing has settled on the reference model\n");
+    printf("\t-r\twith -q, resume from the latest checkpoint in <file>.ckpt the edits since didn't affect\n");
+    printf("\t-p\tpipeline config, keys: mem (extra lw/sw cycles), early (1: no load-use stall),\n");
+    printf("\t\tpredict (nt, bt: backward taken, t), resolve (mem or ex)\n");
+    printf("\t-f\tfunctional: run on the reference model, no pipeline\n");
+    printf("\t-debug\tstep through the pipeline with breakpoints and watchpoints, commands on stdin\n");
+    printf("\t-gen\tprint a random program that always halts\n");
+    printf("\t-fuzz\trun n random programs under -c on jobs threads\n");
+    printf("\t-bench\ttime each file in every mode, compare against a baseline CSV\n");
+    printf("\t-sweep\trun every combination of -p values on jobs threads, one CSV or JSON row each\n");
+    printf("\t-trace\trecord the instructions the program retires, for -sweep to replay\n");
+    printf("\t-sample\testimate cycles from short pipeline windows, full=1 to compare with a full run\n");
+    printf("\t-lanes\trun n generated programs on the lane-parallel engine, simd=0 for no AVX2\n");
+    printf("\t-multi\trun cores copies of the program sharing data memory, core id in reg 7,\n");
+    printf("\t\tstores seen by other cores every quantum cycles; scale=1 times 1, 2, 4... cores\n");
+    printf("\t-memprof\tstack distances, LRU miss rates, working sets and hottest words of fetches and\n");
+    printf("\t\tdata accesses; out=file for the miss rate at every cache size\n");
+    printf("A file ending in .as, .s or .lc2k is assembled first.\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+
+    /* Declare state and newState.
+       Note these have static lifetime so that instrMem and
+       dataMem are not allocated on the stack. */
 
+    static stateType state, newState;
+    static cosimType cosim;
+    int check = 0;
+    int quiet = 0;
+    int functional = 0;
+    int debug = 0;
+    int loops = 0;
+    int resume = 0;
+    configType config = defaultConfig;
+    char *filename = NULL;
 
-        // two write back cases
-        // add and nor (effectivly the same)
-        // lw
-        // fuck me i had exmem for nor instesad of wbend
-        if (opcode(newState.WBEND.instr) == ADD || opcode(newState.WBEND.instr) == NOR){
-            newState.reg[field2(state.MEMWB.instr)] = state.MEMWB.writeData; // set reg at field2 to writeData
+    PROF_INIT();
+    for (int i = 1; i < argc; i++){
+        if (strcmp(argv[i], "-c") == 0){
+            check = 1;
+        }
+        else if (strcmp(argv[i], "-q") == 0){
+            quiet = 1;
+        }
+        else if (strcmp(argv[i], "-f") == 0){
+            functional = 1;
         }
-        // changed to if instead of else if
-        if (opcode(newState.WBEND.instr) == LW){
-            newState.reg[field1(state.MEMWB.instr)] = state.MEMWB.writeData; // set reg at field1 to writeData
+        else if (strcmp(argv[i], "-l") == 0){
+            loops = 1;
         }
+        else if (strcmp(argv[i], "-r") == 0){
+            resume = 1;
+        }
+        else if (strcmp(argv[i], "-debug") == 0){
+            debug = 1;
+        }
+        else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc){
+            specCheck(argv[++i], CONFIG_KEYS);
+            configParse(&config, argv[i]);
+        }
+        else if (strcmp(argv[i], "-bench") == 0 && i + 2 < argc){
+            return benchMain(argv[i + 1], argc - i - 2, argv + i + 2);
+        }
+        else if (strcmp(argv[i], "-sweep") == 0 && i + 2 == argc - 1){
+            return sweepMain(argv[i + 1], argv[i + 2]);
+        }
+        else if (strcmp(argv[i], "-trace") == 0 && i + 2 == argc - 1){
+            return traceMain(argv[i + 1], argv[i + 2]);
+        }
+        else if (strcmp(argv[i], "-sample") == 0 && i + 2 == argc - 1){
+            return sampleMain(argv[i + 1], argv[i + 2]);
+        }
+        else if (strcmp(argv[i], "-multi") == 0 && i + 2 == argc - 1){
+            return multiMain(argv[i + 1], argv[i + 2]);
+        }
+        else if (strcmp(argv[i], "-memprof") == 0 && i + 2 == argc - 1){
+            return memprofMain(argv[i + 1], argv[i + 2]);
+        }
+        else if (strcmp(argv[i], "-lanes") == 0 && i + 1 < argc){
+            return lanesMain(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-gen") == 0 && i + 1 < argc){
+            return genMain(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-fuzz") == 0 && i + 1 < argc){
+            return fuzzMain(argv[i + 1]);
+        }
+        else if (argv[i][0] == '-' || filename){
+            usage(argv[0]);
+        }
+        else{
+            filename = argv[i];
+        }
+    }
+    if (!filename){
+        usage(argv[0]);
+    }
+
+    if ((check || quiet) && functional){
+        usage(argv[0]);
+    }
+    if ((loops || resume) && (!quiet || check || (loops && resume))){
+        usage(argv[0]);
+    }
+    if (debug && (check || quiet || functional)){
+        usage(argv[0]);
+    }
 
+    loadProgram(&state, filename);
+    resetState(&state);
 
-        /* ------------------------ END ------------------------ */
-        state = newState; /* this is the last statement before end of the loop. It marks the end
-        of the cycle and updates the current state with the values calculated in this cycle */
+    if (functional){
+        // one instruction per cycle; the pipeline registers stay empty
+        state.cycles = funcRun(&state);
+        printf("Machine halted\n");
+        printf("Total of %d instructions executed\n", state.cycles);
+        printf("Final state of machine:\n");
+        printState(&state);
+        return 0;
+    }
+
+    PROF_REGION(PROF_COPY);
+    newState = state; // the only full copy, from here on only the latches are copied
+    PROF_REGION(PROF_OTHER);
+    if (debug){
+        return debugMain(&config, &state, &newState);
+    }
+    if (check){
+        cosimInit(&cosim, &state);
+    }
+    if (loops){
+        simulateLoops(&config, &state, &newState);
+    }
+    else if (resume){
+        simulateIncremental(&config, &state, &newState, filename);
+    }
+    else if (simulate(&config, &state, &newState, !quiet, check ? &cosim : NULL, -1) < 0){
+        cosimReport(&cosim);
+        exit(1);
     }
     printf("Machine halted\n");
     printf("Total of %d cycles executed\n", state.cycles);
     printf("Final state of machine:\n");
+    PROF_REGION(PROF_PRINT);
     printState(&state);
+    PROF_REGION(PROF_OTHER);
 }
 
 /*
@@ -510,7 +4747,6 @@ void printState(stateType *statePtr) {
 }
 
 // File
-#define MAXLINELENGTH 1000 // MAXLINELENGTH is the max number of characters we read
 
 void readMachineCode(stateType *state, char* filename) {
     char line[MAXLINELENGTH];